@@ -0,0 +1,410 @@
+/*
+ * Benchmark for make_bsdiff()
+ *
+ * Diffs synthetic artifact pairs of various sizes and entropy levels
+ * (and any recorded pairs given on the command line) and reports
+ * timing, peak RSS and patch ratio as JSON on stdout.
+ *
+ * Each pair is diffed in a forked child so peak RSS can be measured
+ * per pair.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "bsdiff.h"
+
+static int verbose;
+
+/**
+ * bsdiff.c logs through libsvc, we just print to stderr
+ */
+void
+trace(int level, const char *fmt, ...)
+{
+  va_list ap;
+
+  if(!verbose)
+    return;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+}
+
+
+/**
+ *
+ */
+typedef struct bench_result {
+  bsdiff_stats_t stats;
+  char kernels[16];
+  off_t oldsize;
+  off_t newsize;
+  off_t patchsize;
+  int rval;
+} bench_result_t;
+
+
+/**
+ * Deterministic so results are comparable between runs
+ */
+static uint64_t
+rnd(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+
+#define ENTROPY_LOW    0  // Text-like
+#define ENTROPY_MEDIUM 1  // Executable-like
+#define ENTROPY_HIGH   2  // Already compressed
+
+static const char *entropy_names[] = {"low", "medium", "high"};
+
+
+/**
+ *
+ */
+static void
+generate_old(u_char *buf, size_t size, int entropy, uint64_t *seed)
+{
+  static const char *words[] = {
+    "the ", "release ", "artifact ", "build ", "patch ", "track ",
+    "version ", "target ", "\n", "{", "}", "  ", "doozer ", "0x1f, ",
+  };
+  size_t i = 0;
+
+  switch(entropy) {
+  case ENTROPY_LOW:
+    while(i < size) {
+      const char *w = words[rnd(seed) % (sizeof(words) / sizeof(words[0]))];
+      while(*w && i < size)
+        buf[i++] = *w++;
+    }
+    break;
+
+  case ENTROPY_MEDIUM:
+    // A few common "opcodes" followed by operands, some of them
+    // pointer-like and thus shared across the file
+    for(; i < size; i++) {
+      uint64_t r = rnd(seed);
+      switch(i & 3) {
+      case 0:
+        buf[i] = 0x40 + (r % 24);
+        break;
+      case 1:
+        buf[i] = r % 7 ? 0 : r >> 8;
+        break;
+      default:
+        buf[i] = r % 3 ? (i >> 10) : r >> 16;
+        break;
+      }
+    }
+    break;
+
+  default:
+    for(; i < size; i++)
+      buf[i] = rnd(seed);
+    break;
+  }
+}
+
+
+/**
+ * Derive a new version from 'old' by modifying, inserting and deleting
+ * small regions every few kB
+ */
+static size_t
+generate_new(u_char *out, size_t outsize, const u_char *old, size_t oldsize,
+             uint64_t *seed)
+{
+  size_t i = 0, o = 0;
+
+  while(i < oldsize && o < outsize) {
+    size_t run = MIN(1024 + rnd(seed) % 8192, oldsize - i);
+    run = MIN(run, outsize - o);
+    memcpy(out + o, old + i, run);
+    i += run;
+    o += run;
+
+    size_t len = 1 + rnd(seed) % 64;
+    switch(rnd(seed) % 4) {
+    case 0: // Insert
+      for(; len > 0 && o < outsize; len--)
+        out[o++] = rnd(seed);
+      break;
+    case 1: // Delete
+      i += MIN(len, oldsize - i);
+      break;
+    default: // Modify
+      for(; len > 0 && o < outsize && i < oldsize; len--, i++)
+        out[o++] = old[i] + 1 + rnd(seed) % 3;
+      break;
+    }
+  }
+  return o;
+}
+
+
+/**
+ *
+ */
+static u_char *
+load(const char *path, off_t *sizep)
+{
+  struct stat st;
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL)
+    return NULL;
+  if(fstat(fileno(fp), &st)) {
+    fclose(fp);
+    return NULL;
+  }
+  u_char *buf = malloc(st.st_size + 1);
+  if(buf == NULL ||
+     fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  *sizep = st.st_size;
+  return buf;
+}
+
+
+/**
+ * Runs in the child
+ */
+static void
+run_one(bench_result_t *br, const char *oldpath, const char *newpath,
+        size_t size, int entropy, const bsdiff_opts_t *o,
+        const char *patchfile)
+{
+  u_char *old, *new;
+  off_t oldsize, newsize;
+  bsdiff_opts_t opts = *o;
+  struct stat st;
+
+  br->rval = -1;
+
+  if(oldpath != NULL) {
+    if((old = load(oldpath, &oldsize)) == NULL ||
+       (new = load(newpath, &newsize)) == NULL) {
+      fprintf(stderr, "Unable to load %s / %s -- %s\n",
+              oldpath, newpath, strerror(errno));
+      return;
+    }
+  } else {
+    uint64_t seed = 0x9e3779b97f4a7c15ULL ^ (size * 3 + entropy);
+    oldsize = size;
+    old = malloc(size + 1);
+    new = malloc(size + size / 8 + 1);
+    generate_old(old, size, entropy, &seed);
+    newsize = generate_new(new, size + size / 8, old, size, &seed);
+  }
+
+  opts.stats = &br->stats;
+  br->oldsize = oldsize;
+  br->newsize = newsize;
+  br->rval = make_bsdiff(old, oldsize, new, newsize, patchfile, &opts);
+  if(!stat(patchfile, &st))
+    br->patchsize = st.st_size;
+  unlink(patchfile);
+  if(br->stats.kernels != NULL)
+    snprintf(br->kernels, sizeof(br->kernels), "%s", br->stats.kernels);
+  br->stats.kernels = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+json_str(char *dst, size_t dstlen, const char *src)
+{
+  size_t o = 0;
+  for(; *src && o + 7 < dstlen; src++) {
+    if(*src == '"' || *src == '\\') {
+      dst[o++] = '\\';
+      dst[o++] = *src;
+    } else if((unsigned char)*src < 0x20) {
+      o += snprintf(dst + o, dstlen - o, "\\u%04x", *src);
+    } else {
+      dst[o++] = *src;
+    }
+  }
+  dst[o] = 0;
+}
+
+
+/**
+ *
+ */
+static int
+bench(const char *name, const char *oldpath, const char *newpath,
+      size_t size, int entropy, const bsdiff_opts_t *opts,
+      const char *patchfile, int first)
+{
+  bench_result_t br;
+  struct rusage ru;
+  int fds[2], status;
+
+  if(pipe(fds))
+    return -1;
+
+  pid_t pid = fork();
+  if(pid == -1)
+    return -1;
+
+  if(pid == 0) {
+    close(fds[0]);
+    memset(&br, 0, sizeof(br));
+    run_one(&br, oldpath, newpath, size, entropy, opts, patchfile);
+    if(write(fds[1], &br, sizeof(br)) != sizeof(br))
+      _exit(1);
+    _exit(0);
+  }
+
+  char jname[PATH_MAX * 4];
+  json_str(jname, sizeof(jname), name);
+
+  close(fds[1]);
+  ssize_t r = read(fds[0], &br, sizeof(br));
+  close(fds[0]);
+
+  if(wait4(pid, &status, 0, &ru) == -1 || r != sizeof(br) ||
+     !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s: Benchmark process failed\n", name);
+    return -1;
+  }
+
+  printf("%s    {\"name\": \"%s\", \"kernels\": \"%s\", \"result\": %d,\n"
+         "     \"oldsize\": %jd, \"newsize\": %jd, \"patchsize\": %jd, "
+         "\"ratio\": %.6f,\n"
+         "     \"sort_time\": %.3f, \"scan_time\": %.3f, "
+         "\"compress_time\": %.3f, \"total_time\": %.3f,\n"
+         "     \"peak_rss_kb\": %ld}",
+         first ? "" : ",\n",
+         jname, br.kernels, br.rval,
+         (intmax_t)br.oldsize, (intmax_t)br.newsize, (intmax_t)br.patchsize,
+         br.newsize ? (double)br.patchsize / br.newsize : 0.0,
+         br.stats.sort_time, br.stats.scan_time,
+         br.stats.compress_time, br.stats.total_time,
+         ru.ru_maxrss);
+  fflush(stdout);
+  return br.rval;
+}
+
+
+/**
+ *
+ */
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Usage: %s [options] [OLD NEW ...]\n"
+          "  -t THREADS    Threads (default: number of CPUs)\n"
+          "  -z            Use zstd compression instead of bzip2\n"
+          "  -l LEVEL      zstd compression level\n"
+          "  -m MB         Largest synthetic artifact size (default 16)\n"
+          "  -n            Skip the synthetic pairs\n"
+          "  -v            Log from bsdiff\n"
+          "\n"
+          "Recorded artifact pairs can be given as OLD NEW arguments\n",
+          argv0);
+  exit(1);
+}
+
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+  bsdiff_opts_t opts = {
+    .threads = sysconf(_SC_NPROCESSORS_ONLN),
+    .compression = BSDIFF_COMPRESS_BZIP2,
+  };
+  int maxmb = 16;
+  int synthetic = 1;
+  int c, errors = 0, first = 1;
+  char patchfile[PATH_MAX];
+  char name[PATH_MAX * 2 + 16];
+
+  while((c = getopt(argc, argv, "t:zl:m:nvh")) != -1) {
+    switch(c) {
+    case 't':
+      opts.threads = atoi(optarg);
+      break;
+    case 'z':
+      opts.compression = BSDIFF_COMPRESS_ZSTD;
+      break;
+    case 'l':
+      opts.level = atoi(optarg);
+      break;
+    case 'm':
+      maxmb = atoi(optarg);
+      break;
+    case 'n':
+      synthetic = 0;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if((argc - optind) & 1)
+    usage(argv[0]);
+
+  snprintf(patchfile, sizeof(patchfile), "%s/bsdiff-bench-%d.patch",
+           getenv("TMPDIR") ?: "/tmp", getpid());
+
+  printf("{\"threads\": %d, \"compression\": \"%s\", \"results\": [\n",
+         opts.threads,
+         opts.compression == BSDIFF_COMPRESS_ZSTD ? "zstd" : "bzip2");
+
+  if(synthetic) {
+    for(int mb = 1; mb <= maxmb; mb *= 4) {
+      for(int e = ENTROPY_LOW; e <= ENTROPY_HIGH; e++) {
+        snprintf(name, sizeof(name), "synthetic-%dM-%s",
+                 mb, entropy_names[e]);
+        errors += !!bench(name, NULL, NULL, (size_t)mb * 1024 * 1024, e,
+                          &opts, patchfile, first);
+        first = 0;
+      }
+    }
+  }
+
+  for(int i = optind; i < argc; i += 2) {
+    snprintf(name, sizeof(name), "%s -> %s", argv[i], argv[i + 1]);
+    errors += !!bench(name, argv[i], argv[i + 1], 0, 0,
+                      &opts, patchfile, first);
+    first = 0;
+  }
+
+  printf("\n]}\n");
+  return !!errors;
+}
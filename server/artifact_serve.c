@@ -3,6 +3,7 @@
 #include <sys/param.h>
 #include <sys/sendfile.h>
 #include <sys/mman.h>
+#include <sys/queue.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,75 +25,115 @@
 #include "libsvc/trace.h"
 #include "libsvc/cfg.h"
 #include "libsvc/db.h"
+#include "libsvc/threading.h"
 
 #include "artifact_serve.h"
 #include "doozer.h"
 #include "bsdiff.h"
+#include "patchstash.h"
 #include "project.h"
 #include "sql_statements.h"
 
 static pthread_mutex_t patch_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#define TMPMEMSIZE (1024 * 1024 * 1024)
+// zlib counts in uInt, feed it at most this much per call
+#define INFLATE_STEP (1024 * 1024 * 1024)
 
 /**
+ * Inflate the gzip file open at 'fd' into a malloc'ed buffer
  *
+ * 'origsize' is the uncompressed size as recorded for the artifact.
+ * If it's known (non-zero) we inflate straight into a buffer of that
+ * size, otherwise (or if it turns out to be wrong) the buffer grows
+ * as we go. 'fd' is always closed.
  */
 static void *
-load_fd(int fd, int insize, size_t *outsize, int gzipped)
+load_fd(int fd, off_t insize, size_t origsize, size_t *outsize)
 {
-  void *in = malloc(insize);
-
-  if(in == NULL) {
+  if(insize == 0) {
     close(fd);
+    errno = EINVAL;
     return NULL;
   }
 
-  if(read(fd, in, insize) != insize) {
-    free(in);
-    close(fd);
-    return NULL;
-  }
+  void *in = mmap(NULL, insize, PROT_READ, MAP_PRIVATE, fd, 0);
   close(fd);
+  if(in == MAP_FAILED)
+    return NULL;
 
+  madvise(in, insize, MADV_SEQUENTIAL);
 
-  if(!gzipped) {
-    *outsize = insize;
-    return in;
-  }
-
-  void *out = mmap(NULL, TMPMEMSIZE,
-                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
-                   -1, 0);
-
-  if(out == MAP_FAILED) {
-    free(in);
-    return NULL;
-  }
+  size_t cap = origsize ?: MAX((size_t)insize * 4, 65536);
+  size_t len = 0;
+  off_t inpos = 0;
+  u_char *out = malloc(cap);
+  int r = Z_OK;
 
   z_stream z;
   memset(&z, 0, sizeof(z));
   inflateInit2(&z, 16+MAX_WBITS);
 
-  z.next_in  = in;
-  z.avail_in = insize;
-  z.next_out = out;
-  z.avail_out = TMPMEMSIZE;
+  while(out != NULL) {
+
+    if(len == cap) {
+      cap *= 2;
+      void *n = realloc(out, cap);
+      if(n == NULL) {
+        free(out);
+        out = NULL;
+        break;
+      }
+      out = n;
+    }
+
+    z.next_in   = (u_char *)in + inpos;
+    z.avail_in  = MIN(insize - inpos, INFLATE_STEP);
+    z.next_out  = out + len;
+    z.avail_out = MIN(cap - len, INFLATE_STEP);
+
+    const size_t avail_in = z.avail_in;
+    const size_t avail_out = z.avail_out;
+
+    r = inflate(&z, Z_NO_FLUSH);
+
+    inpos += avail_in - z.avail_in;
+    len += avail_out - z.avail_out;
+
+    if(r == Z_STREAM_END)
+      break;
+
+    if(r != Z_OK && r != Z_BUF_ERROR) {
+      free(out);
+      out = NULL;
+      break;
+    }
+
+    if(inpos == insize && z.avail_out) {
+      // Truncated input
+      free(out);
+      out = NULL;
+      break;
+    }
+  }
 
-  int r = inflate(&z, Z_FINISH);
-  free(in);
   inflateEnd(&z);
-  if(r < 0) {
-    munmap(out, TMPMEMSIZE);
+  munmap(in, insize);
+
+  if(out == NULL) {
+    errno = EINVAL;
     return NULL;
   }
 
-  *outsize = TMPMEMSIZE - z.avail_out;
-
-  void *ret = malloc(*outsize);
-  memcpy(ret, out, *outsize);
-  munmap(out, TMPMEMSIZE);
-  return ret;
+  if(len != origsize) {
+    if(origsize)
+      trace(LOG_WARNING, "Recorded origsize %zu does not match "
+            "inflated size %zu", origsize, len);
+    void *n = realloc(out, MAX(len, 1));
+    if(n != NULL)
+      out = n;
+  }
+  *outsize = len;
+  return out;
 }
 
 
@@ -100,8 +141,34 @@ load_fd(int fd, int insize, size_t *outsize, int gzipped)
  *
  */
 static void *
-load_file(const char *path, size_t *outsize, int gzipped)
+load_file(const char *path, size_t origsize, size_t *outsize)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd == -1)
+    return NULL;
+
+  struct stat st;
+  if(fstat(fd, &st)) {
+    int r = errno;
+    close(fd);
+    errno = r;
+    return NULL;
+  }
+  return load_fd(fd, st.st_size, origsize, outsize);
+}
+
+
+/**
+ * Get the contents of an artifact file. Files that are not gzipped
+ * are mapped read-only, gzipped ones are inflated with load_file().
+ * Release with unmap_file()
+ */
+static void *
+map_file(const char *path, size_t *outsize, int gzipped, size_t origsize)
 {
+  if(gzipped)
+    return load_file(path, origsize, outsize);
+
   int fd = open(path, O_RDONLY);
   if(fd == -1)
     return NULL;
@@ -113,7 +180,34 @@ load_file(const char *path, size_t *outsize, int gzipped)
     errno = r;
     return NULL;
   }
-  return load_fd(fd, st.st_size, outsize, gzipped);
+
+  // Can't map an empty file, hand out an anonymous page instead
+  void *p;
+  if(st.st_size == 0)
+    p = mmap(NULL, 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  else
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(p == MAP_FAILED)
+    return NULL;
+
+  madvise(p, MAX(st.st_size, 1), MADV_WILLNEED);
+  *outsize = st.st_size;
+  return p;
+}
+
+
+/**
+ *
+ */
+static void
+unmap_file(void *p, size_t size, int gzipped)
+{
+  if(gzipped)
+    free(p);
+  else
+    munmap(p, MAX(size, 1));
 }
 
 
@@ -140,124 +234,284 @@ do_send_file(http_connection_t *hc, const char *ct,
 
 
 /**
+ * Diff the artifact 'oldsha1' against 'newpath' into 'tmppath'
  *
+ * Returns 0 on success, BSDIFF_TOO_LARGE if the patch is not
+ * worthwhile and -1 on other errors
  */
 static int
-send_patch(http_connection_t *hc, const char *oldsha1, const char *newsha1,
-           const char *newpath, const char *newencoding,
-           db_conn_t *c, const char *basepath)
+patch_generate(const char *oldsha1, const char *newsha1,
+               const char *newpath, const char *newencoding,
+               size_t neworigsize, db_conn_t *c, const char *basepath,
+               int compression, off_t maxsize, const char *tmppath)
 {
-  if(newencoding != NULL && strcmp(newencoding, "gzip"))
-    return 1;
+  cfg_root(root);
+
+  // Make sure ''old'' file can be resolved before
+  // we do anything else
 
+  db_stmt_t *s = db_stmt_get(c, SQL_GET_ARTIFACT_BY_SHA1);
+
+  if(db_stmt_exec(s, "s", oldsha1))
+    return -1;
+
+  char storage[32];
+  char payload[20000];
+  char project[128];
+  char name[256];
+  char type[128];
+  char content_type[128];
+  char content_encoding[128];
+  char origsizetxt[32];
+  int r = db_stream_row(0, s,
+                        DB_RESULT_STRING(storage),
+                        DB_RESULT_STRING(payload),
+                        DB_RESULT_STRING(project),
+                        DB_RESULT_STRING(name),
+                        DB_RESULT_STRING(type),
+                        DB_RESULT_STRING(content_type),
+                        DB_RESULT_STRING(content_encoding),
+                        DB_RESULT_STRING(origsizetxt),
+                        NULL);
+
+  db_stmt_reset(s);
+
+  // origsize is a BIGINT, read it as text to get all 64 bits
+  const size_t origsize = r ? 0 : strtoull(origsizetxt, NULL, 10);
+
+  if(r) {
+    trace(LOG_DEBUG, "Unable to patch from unknown SHA-1 %s", oldsha1);
+    return -1;
+  }
+
+  char oldpath[PATH_MAX];
+  snprintf(oldpath, sizeof(oldpath), "%s/%s", basepath, payload);
+
+  trace(LOG_INFO, "Generating new patch between %s (%s) => %s (%s)",
+        oldsha1, oldpath, newsha1, newpath);
+
+  size_t newsize, oldsize;
+
+  const int newgz = !strcmp(newencoding ?: "", "gzip");
+  const int oldgz = !strcmp(content_encoding, "gzip");
+
+  void *new = map_file(newpath, &newsize, newgz, neworigsize);
+  if(new == NULL) {
+    trace(LOG_ERR, "Unable to open file %s for patch creation -- %s",
+          newpath, strerror(errno));
+    return -1;
+  }
+
+  void *old = map_file(oldpath, &oldsize, oldgz, origsize);
+  if(old == NULL) {
+    trace(LOG_ERR, "Unable to open file %s for patch creation -- %s",
+          oldpath, strerror(errno));
+    unmap_file(new, newsize, newgz);
+    return -1;
+  }
+
+  bsdiff_opts_t opts = {
+    .threads = cfg_get_int(root, CFG("bsdiff", "threads"),
+                           sysconf(_SC_NPROCESSORS_ONLN)),
+    .compression = compression,
+    .level = cfg_get_int(root, CFG("bsdiff", "zstdLevel"), 3),
+    .maxsize = maxsize,
+  };
+
+  char sacache[PATH_MAX];
+  if(!patchstash_sacache_path(oldsha1, sacache, sizeof(sacache),
+                              &opts.sacache_store))
+    opts.sacache = sacache;
+
+  int rval = make_bsdiff(old, oldsize, new, newsize, tmppath, &opts);
+
+  trace(LOG_INFO, "Generated patch between %s (%s) => %s (%s) -- error: %d",
+        oldsha1, oldpath, newsha1, newpath, rval);
+
+  unmap_file(new, newsize, newgz);
+  unmap_file(old, oldsize, oldgz);
+  return rval == BSDIFF_TOO_LARGE ? rval : rval ? -1 : 0;
+}
+
+
+/**
+ * Patches currently being generated, protected by patch_mutex.
+ * patch_gen_cond is signalled whenever one of them is done.
+ */
+typedef struct patch_gen {
+  LIST_ENTRY(patch_gen) pg_link;
+  const char *pg_name;
+} patch_gen_t;
+
+static LIST_HEAD(, patch_gen) patch_gens;
+static pthread_cond_t patch_gen_cond = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * Open the patch between 'oldsha1' and 'newsha1' from the patchstash,
+ * generating it first if it's not there yet.
+ *
+ * Patches that are not sufficiently smaller than the new artifact
+ * itself are not worth serving. Such pairs are remembered by the
+ * patchstash so we never spend time diffing them again.
+ *
+ * patch_mutex is only held while looking in the stash and while
+ * storing the result. Generation runs unlocked and concurrent
+ * requests for the same patch wait for it instead of diffing again.
+ *
+ * Returns an open file descriptor or -1 on failure
+ */
+static int
+patch_open(const char *oldsha1, const char *newsha1,
+           const char *newpath, const char *newencoding, size_t neworigsize,
+           db_conn_t *c, const char *basepath, int compression,
+           char *patchfile, size_t patchfilelen)
+{
   int err;
-  char patchfile[PATH_MAX];
-  char ce[256];
-  const char *ct = "binary/bsdiff";
+  char tmppath[PATH_MAX];
   cfg_root(root);
 
-  snprintf(ce, sizeof(ce), "bspatch-from-%s", oldsha1);
-
   const char *patchstash = cfg_get_str(root, CFG("patchstash"),
                                        "/var/tmp/doozer/patchstash");
 
   if((err = makedirs(patchstash)) != 0) {
     trace(LOG_ERR, "Unable to create patchstash directory %s -- %s",
           patchstash, strerror(errno));
-    return 1;
+    return -1;
   }
 
-  snprintf(patchfile, sizeof(patchfile), "%s/%s-%s", patchstash,
-           oldsha1, newsha1);
+  // zstd variants are stashed separately from the classic bzip2 ones
 
-  pthread_mutex_lock(&patch_mutex);
+  char pname[128];
+  snprintf(pname, sizeof(pname), "%s-%s%s", oldsha1, newsha1,
+           compression == BSDIFF_COMPRESS_ZSTD ? ".zst" : "");
 
-  int fd = open(patchfile, O_RDONLY);
-  if(fd == -1) {
+  snprintf(patchfile, patchfilelen, "%s/%s", patchstash, pname);
 
-    // Make sure ''old'' file can be resolved before
-    // we do anything else
+  struct stat st;
+  if(stat(newpath, &st)) {
+    trace(LOG_ERR, "Unable to stat file %s for patching -- %s",
+          newpath, strerror(errno));
+    return -1;
+  }
 
-    db_stmt_t *s = db_stmt_get(c, SQL_GET_ARTIFACT_BY_SHA1);
+  const int maxpct = cfg_get_int(root, CFG("bsdiff", "maxPatchPercent"), 75);
+  const off_t maxsize = maxpct > 0 ? (off_t)st.st_size * maxpct / 100 : 0;
 
-    if(db_stmt_exec(s, "s", oldsha1)) {
-      pthread_mutex_unlock(&patch_mutex);
-      return 1;
-    }
+  pthread_mutex_lock(&patch_mutex);
 
-    char storage[32];
-    char payload[20000];
-    char project[128];
-    char name[256];
-    char type[128];
-    char content_type[128];
-    char content_encoding[128];
-    int r = db_stream_row(0, s,
-                          DB_RESULT_STRING(storage),
-                          DB_RESULT_STRING(payload),
-                          DB_RESULT_STRING(project),
-                          DB_RESULT_STRING(name),
-                          DB_RESULT_STRING(type),
-                          DB_RESULT_STRING(content_type),
-                          DB_RESULT_STRING(content_encoding),
-                          NULL);
-
-    db_stmt_reset(s);
-
-    if(r) {
+  while(1) {
+    if(patchstash_is_negative(pname)) {
       pthread_mutex_unlock(&patch_mutex);
-      trace(LOG_DEBUG, "Unable to patch from unknown SHA-1 %s", oldsha1);
-      return 1;
+      return -1;
     }
 
-    char oldpath[PATH_MAX];
-    snprintf(oldpath, sizeof(oldpath), "%s/%s", basepath, payload);
-
-    trace(LOG_INFO, "Generating new patch between %s (%s) => %s (%s)",
-          oldsha1, oldpath, newsha1, newpath);
+    int fd = open(patchfile, O_RDONLY);
 
-    size_t newsize, oldsize;
-
-    void *new = load_file(newpath, &newsize, !strcmp(newencoding ?: "", "gzip"));
-    if(new == NULL) {
-      trace(LOG_ERR, "Unable to open file %s for patch creation -- %s",
-            newpath, strerror(errno));
+    if(fd != -1 && maxsize && !fstat(fd, &st) && st.st_size > maxsize) {
+      // Stashed before we checked for worthiness
+      trace(LOG_INFO, "Patch %s is not worthwhile, removing", patchfile);
+      close(fd);
+      unlink(patchfile);
+      patchstash_add_negative(pname);
       pthread_mutex_unlock(&patch_mutex);
-      return 1;
+      return -1;
     }
 
-    void *old = load_file(oldpath, &oldsize, !strcmp(content_encoding, "gzip"));
-    if(old == NULL) {
-      trace(LOG_ERR, "Unable to open file %s for patch creation -- %s",
-            oldpath, strerror(errno));
-      free(new);
+    if(fd != -1) {
       pthread_mutex_unlock(&patch_mutex);
-      return 1;
+      return fd;
     }
 
-    int rval = make_bsdiff(old, oldsize, new, newsize, patchfile);
+    patch_gen_t *pg;
+    LIST_FOREACH(pg, &patch_gens, pg_link)
+      if(!strcmp(pg->pg_name, pname))
+        break;
+    if(pg == NULL)
+      break;
+
+    // Someone else is generating it, wait for them and look again
+    pthread_cond_wait(&patch_gen_cond, &patch_mutex);
+  }
 
-    trace(LOG_INFO, "Generated patch between %s (%s) => %s (%s) -- error: %d",
-          oldsha1, oldpath, newsha1, newpath, rval);
+  patch_gen_t gen = { .pg_name = pname };
+  LIST_INSERT_HEAD(&patch_gens, &gen, pg_link);
+  pthread_mutex_unlock(&patch_mutex);
 
-    free(new);
-    free(old);
+  // Generate into a temporary file so a failed or interrupted
+  // run never leaves a truncated patch behind in the stash
 
-    if(rval) {
-      trace(LOG_ERR, "Unable to generate patch file %s", patchfile);
-      pthread_mutex_unlock(&patch_mutex);
-      return 1;
-    }
-    fd = open(patchfile, O_RDONLY);
-    if(fd == -1) {
-      trace(LOG_ERR, "Unable to open generated patch file %s -- %s",
-            patchfile, strerror(errno));
-      pthread_mutex_unlock(&patch_mutex);
-      return 1;
-    }
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", patchfile);
+
+  int rval = patch_generate(oldsha1, newsha1, newpath, newencoding,
+                            neworigsize, c, basepath, compression, maxsize,
+                            tmppath);
+  int fd = -1;
+
+  pthread_mutex_lock(&patch_mutex);
+
+  if(rval == BSDIFF_TOO_LARGE) {
+    trace(LOG_INFO,
+          "Patch between %s => %s exceeds %d%% of %s, not worthwhile",
+          oldsha1, newsha1, maxpct, newpath);
+    unlink(tmppath);
+    patchstash_add_negative(pname);
+    goto done;
+  }
+
+  if(!rval && rename(tmppath, patchfile)) {
+    trace(LOG_ERR, "Unable to rename %s to %s -- %s",
+          tmppath, patchfile, strerror(errno));
+    rval = -1;
+  }
+
+  if(rval) {
+    trace(LOG_ERR, "Unable to generate patch file %s", patchfile);
+    unlink(tmppath);
+    goto done;
   }
 
+  fd = open(patchfile, O_RDONLY);
+  if(fd == -1) {
+    trace(LOG_ERR, "Unable to open generated patch file %s -- %s",
+          patchfile, strerror(errno));
+    goto done;
+  }
+
+  if(!fstat(fd, &st))
+    patchstash_add(pname, st.st_size);
+
+ done:
+  LIST_REMOVE(&gen, pg_link);
+  pthread_cond_broadcast(&patch_gen_cond);
   pthread_mutex_unlock(&patch_mutex);
+  return fd;
+}
+
+
+/**
+ *
+ */
+static int
+send_patch(http_connection_t *hc, const char *oldsha1, const char *newsha1,
+           const char *newpath, const char *newencoding, size_t neworigsize,
+           db_conn_t *c, const char *basepath, int compression)
+{
+  if(newencoding != NULL && strcmp(newencoding, "gzip"))
+    return 1;
+
+  char patchfile[PATH_MAX];
+  char ce[256];
+  const char *ct = "binary/bsdiff";
+
+  snprintf(ce, sizeof(ce), "%s%s",
+           compression == BSDIFF_COMPRESS_ZSTD ?
+           "bspatch-zstd-from-" : "bspatch-from-", oldsha1);
+
+  int fd = patch_open(oldsha1, newsha1, newpath, newencoding, neworigsize,
+                      c, basepath, compression, patchfile, sizeof(patchfile));
+  if(fd == -1)
+    return 1;
 
   struct stat st;
   if(fstat(fd, &st)) {
@@ -268,10 +522,147 @@ send_patch(http_connection_t *hc, const char *oldsha1, const char *newsha1,
     return 1;
   }
 
+  patchstash_hit(strrchr(patchfile, '/') + 1);
   return do_send_file(hc, ct, st.st_size, ce, fd);
 }
 
 
+/**
+ * Background generation of patches, fed by the releasemaker when
+ * new releases are published so the patchstash is warm before
+ * clients start asking for the new version
+ */
+typedef struct patch_job {
+  TAILQ_ENTRY(patch_job) pj_link;
+  char pj_old[41];
+  char pj_new[41];
+  int pj_compression;
+} patch_job_t;
+
+static TAILQ_HEAD(, patch_job) patch_jobs =
+  TAILQ_HEAD_INITIALIZER(patch_jobs);
+static pthread_mutex_t patch_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t patch_job_cond = PTHREAD_COND_INITIALIZER;
+static int patch_precompute_running;
+
+
+/**
+ *
+ */
+void
+artifact_serve_precompute_patch(const char *oldsha1, const char *newsha1,
+                                int compression)
+{
+  patch_job_t *pj;
+
+  if(!patch_precompute_running || !strcmp(oldsha1, newsha1))
+    return;
+
+  scoped_lock(&patch_job_mutex);
+
+  TAILQ_FOREACH(pj, &patch_jobs, pj_link)
+    if(!strcmp(pj->pj_old, oldsha1) && !strcmp(pj->pj_new, newsha1) &&
+       pj->pj_compression == compression)
+      return;
+
+  pj = calloc(1, sizeof(patch_job_t));
+  if(pj == NULL)
+    return;
+  snprintf(pj->pj_old, sizeof(pj->pj_old), "%s", oldsha1);
+  snprintf(pj->pj_new, sizeof(pj->pj_new), "%s", newsha1);
+  pj->pj_compression = compression;
+  TAILQ_INSERT_TAIL(&patch_jobs, pj, pj_link);
+  pthread_cond_signal(&patch_job_cond);
+}
+
+
+/**
+ *
+ */
+static void
+patch_precompute(const patch_job_t *pj)
+{
+  db_conn_t *c = db_get_conn();
+  if(c == NULL)
+    return;
+
+  db_stmt_t *s = db_stmt_get(c, SQL_GET_ARTIFACT_BY_SHA1);
+
+  if(db_stmt_exec(s, "s", pj->pj_new))
+    return;
+
+  char storage[32];
+  char payload[20000];
+  char project[128];
+  char name[256];
+  char type[128];
+  char content_type[128];
+  char content_encoding[128];
+  char origsizetxt[32];
+  int r = db_stream_row(0, s,
+                        DB_RESULT_STRING(storage),
+                        DB_RESULT_STRING(payload),
+                        DB_RESULT_STRING(project),
+                        DB_RESULT_STRING(name),
+                        DB_RESULT_STRING(type),
+                        DB_RESULT_STRING(content_type),
+                        DB_RESULT_STRING(content_encoding),
+                        DB_RESULT_STRING(origsizetxt),
+                        NULL);
+
+  db_stmt_reset(s);
+
+  const size_t origsize = r ? 0 : strtoull(origsizetxt, NULL, 10);
+
+  if(r || strcmp(storage, "file"))
+    return;
+
+  const char *ce = content_encoding[0] ? content_encoding : NULL;
+  if(ce != NULL && strcmp(ce, "gzip"))
+    return;
+
+  const char *basepath = project_get_artifact_path(project);
+  if(basepath == NULL)
+    return;
+
+  char path[PATH_MAX];
+  char patchfile[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", basepath, payload);
+
+  int fd = patch_open(pj->pj_old, pj->pj_new, path, ce, origsize,
+                      c, basepath, pj->pj_compression,
+                      patchfile, sizeof(patchfile));
+  if(fd != -1)
+    close(fd);
+}
+
+
+/**
+ *
+ */
+static void *
+patch_precompute_thread(void *aux)
+{
+  patch_job_t *pj;
+
+  pthread_mutex_lock(&patch_job_mutex);
+  while(1) {
+    if((pj = TAILQ_FIRST(&patch_jobs)) == NULL) {
+      pthread_cond_wait(&patch_job_cond, &patch_job_mutex);
+      continue;
+    }
+    TAILQ_REMOVE(&patch_jobs, pj, pj_link);
+    pthread_mutex_unlock(&patch_job_mutex);
+
+    patch_precompute(pj);
+    free(pj);
+
+    pthread_mutex_lock(&patch_job_mutex);
+  }
+  return NULL;
+}
+
+
 /**
  *
  */
@@ -297,6 +688,7 @@ send_artifact(http_connection_t *hc, const char *remain, void *opaque)
   char type[128];
   char content_type[128];
   char content_encoding[128];
+  char origsizetxt[32];
   int r = db_stream_row(0, s,
                         DB_RESULT_STRING(storage),
                         DB_RESULT_STRING(payload),
@@ -305,10 +697,13 @@ send_artifact(http_connection_t *hc, const char *remain, void *opaque)
                         DB_RESULT_STRING(type),
                         DB_RESULT_STRING(content_type),
                         DB_RESULT_STRING(content_encoding),
+                        DB_RESULT_STRING(origsizetxt),
                         NULL);
 
   db_stmt_reset(s);
 
+  const size_t origsize = r ? 0 : strtoull(origsizetxt, NULL, 10);
+
   switch(r) {
   case DB_ERR_OTHER:
     return 500;
@@ -353,14 +748,33 @@ send_artifact(http_connection_t *hc, const char *remain, void *opaque)
       nencodings = str_tokenize(ae, encodings, 16, ',');
       for(int i = 0; i < nencodings; i++) {
 
+        while(*encodings[i] == ' ')
+          encodings[i]++;
+
         char *x = strchr(encodings[i], ';');
         if(x != NULL)
           *x = 0;
       }
 
-      const char *src;
-      if((src = mystrbegins(ae, "bspatch-from-")) != NULL) {
-        switch(send_patch(hc, src, remain, path, ce, c, basepath)) {
+      // Prefer zstd compressed patches if the client can handle them
+
+      const char *zstdsrc = NULL, *bz2src = NULL;
+      for(int i = 0; i < nencodings; i++) {
+        const char *src;
+        if((src = mystrbegins(encodings[i], "bspatch-zstd-from-")) != NULL)
+          zstdsrc = src;
+        else if((src = mystrbegins(encodings[i], "bspatch-from-")) != NULL)
+          bz2src = src;
+      }
+
+      for(int i = 0; i < 2; i++) {
+        const char *src = i == 0 ? zstdsrc : bz2src;
+        if(src == NULL)
+          continue;
+
+        switch(send_patch(hc, src, remain, path, ce, origsize, c, basepath,
+                          i == 0 ? BSDIFF_COMPRESS_ZSTD :
+                          BSDIFF_COMPRESS_BZIP2)) {
         case -1:
           return -1;
         case 0:
@@ -404,7 +818,7 @@ send_artifact(http_connection_t *hc, const char *remain, void *opaque)
 
       if(!strcasecmp(ce, "gzip")) {
         size_t outsize;
-        void *mem = load_fd(fd, st.st_size, &outsize, 1);
+        void *mem = load_fd(fd, st.st_size, origsize, &outsize);
         if(mem == NULL)
           return 500;
 
@@ -470,5 +884,13 @@ send_artifact(http_connection_t *hc, const char *remain, void *opaque)
 void
 artifact_serve_init(void)
 {
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, patch_precompute_thread, NULL);
+  if(err) {
+    trace(LOG_ERR, "Unable to start patch precompute thread -- %s",
+          strerror(err));
+  } else {
+    patch_precompute_running = 1;
+  }
   http_path_add("/file",  NULL, send_artifact);
 }
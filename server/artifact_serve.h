@@ -2,3 +2,5 @@
 
 void artifact_serve_init(void);
 
+void artifact_serve_precompute_patch(const char *oldsha1, const char *newsha1,
+                                     int compression);
@@ -25,121 +25,192 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bzlib.h>
+#include <zstd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "bsdiff.h"
+#include "sais.h"
 
 #include "libsvc/trace.h"
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
-{
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
-	};
+/*
+ * Suffix array of the old file. Files below 2GB use 32 bit offsets
+ * which cuts the memory needed for sorting to a quarter compared to
+ * the off_t based qsufsort() this used to be.
+ */
+typedef struct bsdiff_sa {
+	int32_t *sa32;
+	int64_t *sa64;
+	void *map;		/* Set if loaded from a cache file */
+	size_t maplen;
+} bsdiff_sa_t;
 
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
-	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+#define SA(sa,i) ((sa)->sa32 ? (off_t)(sa)->sa32[i] : (off_t)(sa)->sa64[i])
 
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+static double bsdiff_now(void)
+{
+	struct timespec ts;
 
-	if(jj>start) split(I,V,start,jj-start,h);
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
 
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
+static off_t offtin(u_char *buf);
+static void offtout(off_t x,u_char *buf);
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+static int sa_build(bsdiff_sa_t *sa,u_char *old,off_t oldsize)
+{
+	sa->sa32=NULL;
+	sa->sa64=NULL;
+	sa->map=NULL;
+
+	if(oldsize<INT32_MAX) {
+		if((sa->sa32=malloc((oldsize+1)*sizeof(int32_t)))==NULL)
+			return -1;
+		if(sais32(old,sa->sa32,oldsize)) {
+			free(sa->sa32);
+			return -1;
+		}
+	} else {
+		if((sa->sa64=malloc((oldsize+1)*sizeof(int64_t)))==NULL)
+			return -1;
+		if(sais64(old,sa->sa64,oldsize)) {
+			free(sa->sa64);
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+static void sa_free(bsdiff_sa_t *sa)
 {
-	off_t buckets[256];
-	off_t i,h,len;
-
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
-
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
-
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
-	};
+	if(sa->map!=NULL) {
+		munmap(sa->map,sa->maplen);
+		return;
+	}
+	free(sa->sa32);
+	free(sa->sa64);
+}
+
+/*
+ * Suffix array cache file is
+	0	8	"BSDSA001"
+	8	8	width of each entry (4 or 8)
+	16	8	length of old file
+	24	8	reserved
+	32	??	(length + 1) entries in host byte order
+ */
+#define BSDIFF_SA_MAGIC "BSDSA001"
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+static int sa_load(bsdiff_sa_t *sa,const char *path,off_t oldsize)
+{
+	struct stat st;
+	u_char *p;
+	off_t width;
+	int fd;
+
+	if((fd=open(path,O_RDONLY))==-1)
+		return -1;
+	if(fstat(fd,&st) || st.st_size<32) {
+		close(fd);
+		return -1;
+	}
+	p=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(p==MAP_FAILED)
+		return -1;
+
+	width=offtin(p+8);
+	if(memcmp(p,BSDIFF_SA_MAGIC,8) || offtin(p+16)!=oldsize ||
+	   width!=(oldsize<INT32_MAX ? 4 : 8) ||
+	   st.st_size!=32+(oldsize+1)*width) {
+		trace(LOG_ERR, "Discarding invalid suffix array cache %s", path);
+		munmap(p,st.st_size);
+		unlink(path);
+		return -1;
+	}
+
+	sa->map=p;
+	sa->maplen=st.st_size;
+	sa->sa32=width==4 ? (int32_t *)(p+32) : NULL;
+	sa->sa64=width==8 ? (int64_t *)(p+32) : NULL;
+
+	/* The match search indexes 'old' with these, never trust them */
+	for(off_t i=0;i<=oldsize;i++) {
+		off_t v=SA(sa,i);
+		if(v<0 || v>oldsize) {
+			trace(LOG_ERR, "Discarding corrupt suffix array cache %s",
+			    path);
+			munmap(p,st.st_size);
+			unlink(path);
+			sa->map=NULL;
+			sa->sa32=NULL;
+			sa->sa64=NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void sa_store(const bsdiff_sa_t *sa,const char *path,off_t oldsize)
+{
+	char tmp[PATH_MAX];
+	u_char header[32];
+	off_t width=sa->sa32 ? 4 : 8;
+	FILE *fp;
+	int fd,err;
+
+	/* Unique name, several patches may cache the same file at once */
+	snprintf(tmp,sizeof(tmp),"%s.XXXXXX",path);
+	if((fd=mkstemp(tmp))==-1 || (fp=fdopen(fd,"w"))==NULL) {
+		trace(LOG_ERR, "Unable to create suffix array cache %s -- %s",
+		    tmp, strerror(errno));
+		if(fd!=-1) {
+			close(fd);
+			unlink(tmp);
+		}
+		return;
+	}
+
+	memset(header,0,sizeof(header));
+	memcpy(header,BSDIFF_SA_MAGIC,8);
+	offtout(width,header+8);
+	offtout(oldsize,header+16);
+
+	err=fwrite(header,32,1,fp)!=1 ||
+	    fwrite(sa->sa32 ? (void *)sa->sa32 : (void *)sa->sa64,
+		width,oldsize+1,fp)!=(size_t)(oldsize+1);
+	if(fclose(fp))
+		err=1;
+	if(err || rename(tmp,path)) {
+		trace(LOG_ERR, "Unable to write suffix array cache %s -- %s",
+		    path, strerror(errno));
+		unlink(tmp);
+	}
 }
 
-static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
+/*
+ * Inner loops, in plain C and vectorized versions picked at runtime
+ * depending on what the CPU supports
+ */
+static off_t matchlen_c(const u_char *old,off_t oldsize,
+    const u_char *new,off_t newsize)
 {
 	off_t i;
 
@@ -149,26 +220,150 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t count_eq_c(const u_char *a,const u_char *b,off_t n)
+{
+	off_t i,r=0;
+
+	for(i=0;i<n;i++)
+		if(a[i]==b[i]) r++;
+	return r;
+}
+
+static void sub_c(u_char *d,const u_char *a,const u_char *b,off_t n)
+{
+	off_t i;
+
+	for(i=0;i<n;i++)
+		d[i]=a[i]-b[i];
+}
+
+static off_t extend_fwd_c(const u_char *old,const u_char *new,off_t n)
+{
+	off_t i,s=0,Sf=0,lenf=0;
+
+	for(i=0;i<n;) {
+		if(old[i]==new[i]) s++;
+		i++;
+		if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+	};
+	return lenf;
+}
+
+static off_t extend_bwd_c(const u_char *old,const u_char *new,off_t n)
+{
+	off_t i,s=0,Sb=0,lenb=0;
+
+	for(i=1;i<=n;i++) {
+		if(old[-i]==new[-i]) s++;
+		if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+	};
+	return lenb;
+}
+
+typedef struct bsdiff_kernels {
+	const char *name;
+	off_t (*matchlen)(const u_char *,off_t,const u_char *,off_t);
+	off_t (*count_eq)(const u_char *,const u_char *,off_t);
+	void (*sub)(u_char *,const u_char *,const u_char *,off_t);
+	off_t (*extend_fwd)(const u_char *,const u_char *,off_t);
+	off_t (*extend_bwd)(const u_char *,const u_char *,off_t);
+} bsdiff_kernels_t;
+
+static const bsdiff_kernels_t kernels_c = {
+	"c",matchlen_c,count_eq_c,sub_c,extend_fwd_c,extend_bwd_c
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SIMD_FN(x) x ## _sse2
+#define SIMD_TARGET __attribute__((target("sse2")))
+#define SIMD_W 16
+#define SIMD_FULL 0xffffU
+#define SIMD_EQMASK(a,b) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8( \
+	_mm_loadu_si128((const __m128i *)(a)), \
+	_mm_loadu_si128((const __m128i *)(b)))))
+#define SIMD_SUB(d,a,b) _mm_storeu_si128((__m128i *)(d),_mm_sub_epi8( \
+	_mm_loadu_si128((const __m128i *)(a)), \
+	_mm_loadu_si128((const __m128i *)(b))))
+#include "bsdiff_simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_W
+#undef SIMD_FULL
+#undef SIMD_EQMASK
+#undef SIMD_SUB
+
+#define SIMD_FN(x) x ## _avx2
+#define SIMD_TARGET __attribute__((target("avx2")))
+#define SIMD_W 32
+#define SIMD_FULL 0xffffffffU
+#define SIMD_EQMASK(a,b) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8( \
+	_mm256_loadu_si256((const __m256i *)(a)), \
+	_mm256_loadu_si256((const __m256i *)(b)))))
+#define SIMD_SUB(d,a,b) _mm256_storeu_si256((__m256i *)(d),_mm256_sub_epi8( \
+	_mm256_loadu_si256((const __m256i *)(a)), \
+	_mm256_loadu_si256((const __m256i *)(b))))
+#include "bsdiff_simd.h"
+#undef SIMD_FN
+#undef SIMD_TARGET
+#undef SIMD_W
+#undef SIMD_FULL
+#undef SIMD_EQMASK
+#undef SIMD_SUB
+
+static const bsdiff_kernels_t kernels_sse2 = {
+	"sse2",matchlen_sse2,count_eq_sse2,sub_sse2,
+	extend_fwd_sse2,extend_bwd_sse2
+};
+
+static const bsdiff_kernels_t kernels_avx2 = {
+	"avx2",matchlen_avx2,count_eq_avx2,sub_avx2,
+	extend_fwd_avx2,extend_bwd_avx2
+};
+#endif
+
+static const bsdiff_kernels_t *K=&kernels_c;
+static pthread_once_t kernels_once=PTHREAD_ONCE_INIT;
+
+static void kernels_init(void)
+{
+	const char *force=getenv("BSDIFF_KERNELS");
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		K=&kernels_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		K=&kernels_sse2;
+	if(force!=NULL && !strcmp(force,"sse2") &&
+	   __builtin_cpu_supports("sse2"))
+		K=&kernels_sse2;
+#endif
+	if(force!=NULL && !strcmp(force,"c"))
+		K=&kernels_c;
+}
+
+static off_t search(const bsdiff_sa_t *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
 	off_t x,y;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		x=K->matchlen(old+SA(I,st),oldsize-SA(I,st),new,newsize);
+		y=K->matchlen(old+SA(I,en),oldsize-SA(I,en),new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=SA(I,st);
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=SA(I,en);
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+	if(memcmp(old+SA(I,x),new,MIN(oldsize-SA(I,x),newsize))<0) {
 		return search(I,old,oldsize,new,newsize,x,en,pos);
 	} else {
 		return search(I,old,oldsize,new,newsize,st,x,pos);
@@ -193,96 +388,372 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+static off_t offtin(u_char *buf)
+{
+	off_t y;
 
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
 
+	if(buf[7]&0x80) y=-y;
 
-int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
-    const char *patchfile)
-{
-	off_t *I,*V;
-	off_t scan,pos = 0,len;
-	off_t lastscan,lastpos,lastoffset;
-	off_t oldscore,scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t overlap,Ss,lens;
-	off_t i;
-	off_t dblen,eblen;
+	return y;
+}
+
+
+/*
+ * The new file is scanned in chunks which can be processed in parallel
+ * against the (read only) suffix array. Each chunk restarts the scan
+ * at old position 0, the seek of the last control triple in a chunk is
+ * adjusted so the chunks can simply be concatenated.
+ *
+ * Scanned chunks are handed, in order, to one compressor per block
+ * (ctrl, diff and extra) and freed as soon as all three are done with
+ * them. Scanners may not get more than BSDIFF_INFLIGHT chunks per
+ * thread ahead of the compressors, so memory use is bounded by the
+ * chunk size rather than by the size of the new file.
+ *
+ * When there is only one chunk (not threaded, or a small file) the
+ * output is the same as from the original bsdiff. Its buffers are
+ * then spilled into the compressors whenever they fill up instead.
+ */
+#define BSDIFF_MIN_CHUNK (1024 * 1024)
+#define BSDIFF_MAX_CHUNK (16 * 1024 * 1024)
+#define BSDIFF_SPILL_SIZE (1024 * 1024)
+#define BSDIFF_INFLIGHT 2
+#define BSDIFF_WRITE_PIECE (1024 * 1024)
+
+typedef struct bsdiff_chunk {
+	off_t start;		/* First byte of new file in this chunk */
+	off_t end;		/* One past the last byte */
+	off_t *ctrl;
+	off_t nctrl,ctrlcap;
 	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
+	off_t dblen,eblen;
+	off_t bufcap;		/* Size of db and eb */
+	int done;		/* Scanned, protected by ctx mutex */
+	int refs;		/* Blocks yet to consume it, ditto */
+	int err;
+} bsdiff_chunk_t;
+
+#define BSDIFF_BLOCK_CTRL  0
+#define BSDIFF_BLOCK_DIFF  1
+#define BSDIFF_BLOCK_EXTRA 2
+
+struct bsdiff_ctx;
+
+typedef struct bsdiff_block {
+	struct bsdiff_ctx *ctx;
+	FILE *f;
+	int type;
+	int compression;
+	int level;
+	BZFILE *bz;
+	ZSTD_CCtx *zc;
+	u_char *zbuf;
+	size_t zbufsize;
+	off_t fstart;		/* File offset where this block starts */
+	off_t zout;		/* Bytes written by zstd */
+	off_t reported;		/* Bytes accounted for in ctx->outbytes */
+	double time;		/* Time spent compressing */
+	char errmsg[64];
+	int rval;
+} bsdiff_block_t;
+
+typedef struct bsdiff_ctx {
+	const bsdiff_sa_t *I;
+	u_char *old;
+	off_t oldsize;
+	u_char *new;
+	bsdiff_chunk_t *chunks;
+	int nchunks;
+	int spill;		/* Single chunk, spill directly into blocks */
+	bsdiff_block_t *blocks;
+	/* Everything below is protected by mutex */
+	int next;		/* Next chunk to scan */
+	int released;		/* Leading chunks consumed by all blocks */
+	int inflight;		/* How far ahead of 'released' to scan */
+	int abort;
+	off_t maxsize;		/* Give up if output grows beyond this */
+	off_t outbytes;		/* Compressed output so far */
+	int toolarge;
+	double scan_time;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} bsdiff_ctx_t;
+
+
+static int zstd_flush(bsdiff_block_t *b,ZSTD_inBuffer *in,ZSTD_EndDirective mode)
+{
+	ZSTD_outBuffer out;
+	size_t r;
+
+	do {
+		out.dst=b->zbuf;
+		out.size=b->zbufsize;
+		out.pos=0;
+		r=ZSTD_compressStream2(b->zc,&out,in,mode);
+		if(ZSTD_isError(r)) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"zstd: %s",
+			    ZSTD_getErrorName(r));
+			return -1;
+		}
+		if(out.pos && fwrite(b->zbuf,1,out.pos,b->f)!=out.pos) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"%s",strerror(errno));
+			return -1;
+		}
+		b->zout+=out.pos;
+	} while(mode==ZSTD_e_end ? r!=0 : in->pos<in->size);
+	return 0;
+}
+
+static int block_open(bsdiff_block_t *b)
+{
 	int bz2err;
 
-	/* Create the patch file */
-	if ((pf = fopen(patchfile, "w")) == NULL) {
-                trace(LOG_ERR, "Unable to create bsdiff file %s -- %s",
-                    patchfile, strerror(errno));
-                return -1;
-        }
+	if((b->fstart=ftello(b->f))==-1) {
+		snprintf(b->errmsg,sizeof(b->errmsg),"%s",strerror(errno));
+		return -1;
+	}
 
+	switch(b->compression) {
+	case BSDIFF_COMPRESS_BZIP2:
+		if((b->bz=BZ2_bzWriteOpen(&bz2err,b->f,9,0,0))==NULL) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"bz2err: %d",bz2err);
+			return -1;
+		}
+		return 0;
+	case BSDIFF_COMPRESS_ZSTD:
+		b->zbufsize=ZSTD_CStreamOutSize();
+		if((b->zc=ZSTD_createCCtx())==NULL ||
+		   (b->zbuf=malloc(b->zbufsize))==NULL) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"Out of memory");
+			return -1;
+		}
+		ZSTD_CCtx_setParameter(b->zc,ZSTD_c_compressionLevel,b->level);
+		return 0;
+	}
+	snprintf(b->errmsg,sizeof(b->errmsg),"Unknown compression");
+	return -1;
+}
 
+/* Add our output to the total and check it against the size limit */
+static int block_account(bsdiff_block_t *b)
+{
+	bsdiff_ctx_t *ctx=b->ctx;
+	off_t cur;
+	int toolarge;
+
+	if(b->bz!=NULL) {
+		if((cur=ftello(b->f))==-1) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"%s",
+			    strerror(errno));
+			return -1;
+		}
+		cur-=b->fstart;
+	} else {
+		cur=b->zout;
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->outbytes+=cur-b->reported;
+	if(ctx->maxsize && ctx->outbytes>ctx->maxsize)
+		ctx->toolarge=1;
+	toolarge=ctx->toolarge;
+	pthread_mutex_unlock(&ctx->mutex);
+	b->reported=cur;
+
+	if(toolarge) {
+		snprintf(b->errmsg,sizeof(b->errmsg),"Patch too large");
+		return -1;
+	}
+	return 0;
+}
 
-	if((I=malloc((oldsize+1)*sizeof(off_t)))==NULL)
-                return -1;
+static int block_write(bsdiff_block_t *b,u_char *data,off_t len)
+{
+	ZSTD_inBuffer in;
+	int bz2err,n;
+
+	while(len>0) {
+		/* Feed in smallish pieces so we can give up early */
+		n=MIN(len,BSDIFF_WRITE_PIECE);
+		if(b->bz!=NULL) {
+			BZ2_bzWrite(&bz2err,b->bz,data,n);
+			if(bz2err!=BZ_OK) {
+				snprintf(b->errmsg,sizeof(b->errmsg),
+				    "bz2err: %d",bz2err);
+				return -1;
+			}
+		} else {
+			in.src=data;
+			in.size=n;
+			in.pos=0;
+			if(zstd_flush(b,&in,ZSTD_e_continue))
+				return -1;
+		}
+		data+=n;
+		len-=n;
+		if(block_account(b))
+			return -1;
+	}
+	return 0;
+}
 
+/* Finish the compressed stream, or throw it away if abort is set */
+static int block_close(bsdiff_block_t *b,int abort)
+{
+	ZSTD_inBuffer in;
+	int bz2err,r=0;
+	double t0=bsdiff_now();
+
+	if(b->bz!=NULL) {
+		BZ2_bzWriteClose(&bz2err,b->bz,abort,NULL,NULL);
+		if(!abort && bz2err!=BZ_OK) {
+			snprintf(b->errmsg,sizeof(b->errmsg),"bz2err: %d",bz2err);
+			r=-1;
+		}
+		b->bz=NULL;
+	}
+	if(b->zc!=NULL) {
+		in.src=NULL;
+		in.size=0;
+		in.pos=0;
+		if(!abort)
+			r=zstd_flush(b,&in,ZSTD_e_end);
+		ZSTD_freeCCtx(b->zc);
+		b->zc=NULL;
+	}
+	free(b->zbuf);
+	b->zbuf=NULL;
+	b->time+=bsdiff_now()-t0;
+	return r;
+}
 
-        if((V=malloc((oldsize+1)*sizeof(off_t)))==NULL) {
-                free(I);
-                return -1;
-        }
+/* Write this block's part of a chunk */
+static int block_write_chunk(bsdiff_block_t *b,const bsdiff_chunk_t *c)
+{
+	u_char buf[8*3*512];
+	off_t i,n;
+	double t0=bsdiff_now();
+	int r=0;
+
+	switch(b->type) {
+	case BSDIFF_BLOCK_CTRL:
+		for(i=0;i<c->nctrl && !r;) {
+			for(n=0;i<c->nctrl && n<(off_t)sizeof(buf);n+=8)
+				offtout(c->ctrl[i++],buf+n);
+			r=block_write(b,buf,n);
+		}
+		break;
+	case BSDIFF_BLOCK_DIFF:
+		r=block_write(b,c->db,c->dblen);
+		break;
+	case BSDIFF_BLOCK_EXTRA:
+		r=block_write(b,c->eb,c->eblen);
+		break;
+	}
+	b->time+=bsdiff_now()-t0;
+	return r;
+}
 
-	qsufsort(I,V,old,oldsize);
+static void set_abort(bsdiff_ctx_t *ctx)
+{
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->abort=1;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->mutex);
+}
 
-	free(V);
+/* Empty the buffers of a single chunk scan into the blocks */
+static int chunk_spill(bsdiff_ctx_t *ctx,bsdiff_chunk_t *c)
+{
+	int i;
 
-	if((db=malloc(newsize+1))==NULL) {
-                free(I);
-                return -1;
-        }
-        if((eb=malloc(newsize+1))==NULL) {
-                free(I);
-                free(db);
-                return -1;
-        }
+	for(i=0;i<3;i++) {
+		if(block_write_chunk(&ctx->blocks[i],c)) {
+			ctx->blocks[i].rval=-1;
+			return -1;
+		}
+	}
+	c->nctrl=0;
+	c->dblen=0;
+	c->eblen=0;
+	return 0;
+}
 
-	dblen=0;
-	eblen=0;
+static void chunk_free(bsdiff_chunk_t *c)
+{
+	free(c->ctrl);
+	free(c->db);
+	free(c->eb);
+	c->ctrl=NULL;
+	c->db=NULL;
+	c->eb=NULL;
+}
 
+static int ctrl_add(bsdiff_chunk_t *c,off_t x,off_t y,off_t z)
+{
+	off_t *ctrl;
+
+	if(c->nctrl+3>c->ctrlcap) {
+		c->ctrlcap=c->ctrlcap ? c->ctrlcap*2 : 3*1024;
+		if((ctrl=realloc(c->ctrl,c->ctrlcap*sizeof(off_t)))==NULL)
+			return -1;
+		c->ctrl=ctrl;
+	}
+	c->ctrl[c->nctrl++]=x;
+	c->ctrl[c->nctrl++]=y;
+	c->ctrl[c->nctrl++]=z;
+	return 0;
+}
 
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-                goto fail;
+static void scan_chunk(bsdiff_ctx_t *ctx,bsdiff_chunk_t *c)
+{
+	const bsdiff_sa_t *I=ctx->I;
+	u_char *old=ctx->old;
+	u_char *new=ctx->new;
+	off_t oldsize=ctx->oldsize;
+	off_t newend=c->end;
+	off_t scan,pos = 0,len;
+	off_t lastscan,lastpos,lastoffset;
+	off_t oldscore,scsc;
+	off_t s,lenf,lenb;
+	off_t overlap,Ss,lens;
+	off_t i,n;
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-                goto fail;
-	scan=0;len=0;
-	lastscan=0;lastpos=0;lastoffset=0;
-	while(scan<newsize) {
+	c->bufcap=c->end-c->start;
+	if(ctx->spill)
+		c->bufcap=MIN(c->bufcap,BSDIFF_SPILL_SIZE);
+
+	if((c->db=malloc(c->bufcap+1))==NULL ||
+	   (c->eb=malloc(c->bufcap+1))==NULL) {
+		c->err=1;
+		return;
+	}
+
+	scan=c->start;len=0;
+	lastscan=c->start;lastpos=0;lastoffset=0;
+	while(scan<newend) {
 		oldscore=0;
 
-		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
+		for(scsc=scan+=len;scan<newend;scan++) {
+			len=search(I,old,oldsize,new+scan,newend-scan,
 					0,oldsize,&pos);
 
-			for(;scsc<scan+len;scsc++)
-			if((scsc+lastoffset<oldsize) &&
-				(old[scsc+lastoffset] == new[scsc]))
-				oldscore++;
+			if(scsc<scan+len) {
+				n=MIN(scan+len,oldsize-lastoffset)-scsc;
+				if(n>0)
+					oldscore+=K->count_eq(old+scsc+lastoffset,
+					    new+scsc,n);
+				scsc=scan+len;
+			}
 
 			if(((len==oldscore) && (len!=0)) || 
 				(len>oldscore+8)) break;
@@ -292,22 +763,14 @@ int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
 				oldscore--;
 		};
 
-		if((len!=oldscore) || (scan==newsize)) {
-			s=0;Sf=0;lenf=0;
-			for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
-				if(old[lastpos+i]==new[lastscan+i]) s++;
-				i++;
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
+		if((len!=oldscore) || (scan==newend)) {
+			lenf=K->extend_fwd(old+lastpos,new+lastscan,
+			    MIN(scan-lastscan,oldsize-lastpos));
 
 			lenb=0;
-			if(scan<newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(old[pos-i]==new[scan-i]) s++;
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
+			if(scan<newend)
+				lenb=K->extend_bwd(old+pos,new+scan,
+				    MIN(scan-lastscan,pos));
 
 			if(lastscan+lenf>scan-lenb) {
 				overlap=(lastscan+lenf)-(scan-lenb);
@@ -324,89 +787,339 @@ int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
 				lenb-=lens;
 			};
 
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=new[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=new[lastscan+lenf+i];
-
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
-
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-                                goto fail2;
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-                                goto fail2;
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-                                goto fail2;
+			/* Buffers only fill up when spilling */
+			for(i=0;i<lenf;i+=n) {
+				if(c->dblen==c->bufcap && chunk_spill(ctx,c))
+					goto fail;
+				n=MIN(lenf-i,c->bufcap-c->dblen);
+				K->sub(c->db+c->dblen,new+lastscan+i,
+				    old+lastpos+i,n);
+				c->dblen+=n;
+			}
+			for(i=0;i<(scan-lenb)-(lastscan+lenf);i+=n) {
+				if(c->eblen==c->bufcap && chunk_spill(ctx,c))
+					goto fail;
+				n=MIN((scan-lenb)-(lastscan+lenf)-i,
+				    c->bufcap-c->eblen);
+				memcpy(c->eb+c->eblen,new+lastscan+lenf+i,n);
+				c->eblen+=n;
+			}
+
+			if(ctx->spill &&
+			   c->nctrl>=(off_t)(BSDIFF_SPILL_SIZE/sizeof(off_t)) &&
+			   chunk_spill(ctx,c))
+				goto fail;
+
+			if(ctrl_add(c,lenf,(scan-lenb)-(lastscan+lenf),
+				    (pos-lenb)-(lastpos+lenf)))
+				goto fail;
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-                goto fail;
 
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-                goto fail;
-	offtout(len-32, header + 8);
+	/* Next chunk starts over at old position 0 */
+	if(c!=&ctx->chunks[ctx->nchunks-1])
+		c->ctrl[c->nctrl-1]-=lastpos;
+	return;
 
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-                goto fail;
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-                goto fail2;
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-                goto fail;
+fail:
+	c->err=1;
+}
 
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-                goto fail;
-	offtout(newsize - len, header + 16);
+static void *scan_thread(void *aux)
+{
+	bsdiff_ctx_t *ctx=aux;
+	bsdiff_chunk_t *c;
+	double t0;
+
+	pthread_mutex_lock(&ctx->mutex);
+	while(!ctx->abort && ctx->next<ctx->nchunks) {
+		if(ctx->next>=ctx->released+ctx->inflight) {
+			pthread_cond_wait(&ctx->cond,&ctx->mutex);
+			continue;
+		}
+		c=&ctx->chunks[ctx->next++];
+		pthread_mutex_unlock(&ctx->mutex);
+
+		t0=bsdiff_now();
+		scan_chunk(ctx,c);
+		t0=bsdiff_now()-t0;
+
+		pthread_mutex_lock(&ctx->mutex);
+		ctx->scan_time+=t0;
+		c->done=1;
+		if(c->err)
+			ctx->abort=1;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
 
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-                goto fail;
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-                goto fail2;
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
+/* Consume the chunks in order as they are scanned */
+static void *compress_block(void *aux)
+{
+	bsdiff_block_t *b=aux;
+	bsdiff_ctx_t *ctx=b->ctx;
+	bsdiff_chunk_t *c;
+	int k,abort=0;
+
+	for(k=0;k<ctx->nchunks && !abort;k++) {
+		c=&ctx->chunks[k];
+
+		pthread_mutex_lock(&ctx->mutex);
+		while(!c->done && !ctx->abort)
+			pthread_cond_wait(&ctx->cond,&ctx->mutex);
+		abort=ctx->abort;
+		pthread_mutex_unlock(&ctx->mutex);
+		if(abort)
+			break;
+
+		if(block_write_chunk(b,c)) {
+			b->rval=-1;
+			set_abort(ctx);
+			break;
+		}
+
+		pthread_mutex_lock(&ctx->mutex);
+		if(--c->refs==0)
+			chunk_free(c);
+		while(ctx->released<ctx->nchunks &&
+		      ctx->chunks[ctx->released].refs==0)
+			ctx->released++;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	abort=ctx->abort;
+	pthread_mutex_unlock(&ctx->mutex);
+
+	if(block_close(b,abort || b->rval))
+		b->rval=-1;
+	return NULL;
+}
+
+static double blocks_time(const bsdiff_block_t *blocks)
+{
+	return blocks[0].time+blocks[1].time+blocks[2].time;
+}
+
+static int copy_file(FILE *dst,FILE *src)
+{
+	char buf[65536];
+	size_t n;
+
+	rewind(src);
+	while((n=fread(buf,1,sizeof(buf),src))>0)
+		if(fwrite(buf,1,n,dst)!=n)
+			return -1;
+	return ferror(src) ? -1 : 0;
+}
+
+int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
+    const char *patchfile, const bsdiff_opts_t *opts)
+{
+	bsdiff_sa_t I;
+	bsdiff_ctx_t ctx;
+	bsdiff_block_t blocks[3];
+	pthread_t tids[BSDIFF_MAX_THREADS+3];
+	off_t chunksize,ctrllen,difflen,patchsize;
+	u_char header[32];
+	FILE * pf;
+	int threads,nthreads,i,rval = -1;
+	int compression,level,err;
+	double t0=bsdiff_now(),t1,ts;
+
+	pthread_once(&kernels_once,kernels_init);
+
+	threads=opts != NULL ? opts->threads : 1;
+	compression=opts != NULL ? opts->compression : BSDIFF_COMPRESS_BZIP2;
+	level=opts != NULL && opts->level ? opts->level : 3;
+	threads=MAX(1,MIN(threads,BSDIFF_MAX_THREADS));
+	memset(blocks,0,sizeof(blocks));
+
+	/* Create the patch file */
+	if ((pf = fopen(patchfile, "w")) == NULL) {
+                trace(LOG_ERR, "Unable to create bsdiff file %s -- %s",
+                    patchfile, strerror(errno));
+                return -1;
+        }
+
+	t1=bsdiff_now();
+	if(opts != NULL && opts->sacache != NULL &&
+	   sa_load(&I,opts->sacache,oldsize)==0) {
+		/* Suffix array of a popular old file, no need to sort */
+	} else if(sa_build(&I,old,oldsize)) {
+                trace(LOG_ERR, "Unable to sort %jd bytes for bsdiff file %s",
+                    (intmax_t)oldsize, patchfile);
+                fclose(pf);
+                return -1;
+        } else if(opts != NULL && opts->sacache != NULL &&
+	    opts->sacache_store) {
+		sa_store(&I,opts->sacache,oldsize);
+	}
+	t1=bsdiff_now()-t1;
+
+	/* Split the new file into chunks, a single one if not threaded */
+	if(threads>1 && newsize>=2*BSDIFF_MIN_CHUNK)
+		chunksize=MIN(BSDIFF_MAX_CHUNK,
+		    MAX(BSDIFF_MIN_CHUNK,newsize/(threads*4)));
+	else
+		chunksize=MAX(newsize,1);
+
+	memset(&ctx,0,sizeof(ctx));
+	ctx.I=&I;
+	ctx.old=old;
+	ctx.oldsize=oldsize;
+	ctx.new=new;
+	ctx.blocks=blocks;
+	ctx.maxsize=opts != NULL ? opts->maxsize : 0;
+	ctx.outbytes=32;
+	ctx.nchunks=(newsize+chunksize-1)/chunksize;
+	ctx.spill=ctx.nchunks<=1;
+	ctx.inflight=threads*BSDIFF_INFLIGHT;
+	pthread_mutex_init(&ctx.mutex,NULL);
+	pthread_cond_init(&ctx.cond,NULL);
+
+	if((ctx.chunks=calloc(MAX(ctx.nchunks,1),sizeof(bsdiff_chunk_t)))==NULL)
+		goto cleanup;
+
+	for(i=0;i<ctx.nchunks;i++) {
+		ctx.chunks[i].start=i*chunksize;
+		ctx.chunks[i].end=MIN(newsize,(i+1)*chunksize);
+		ctx.chunks[i].refs=3;
+	}
+
+	/* Header is
+		0	8	 "BSDIFF40" (or "BSDZST40" for zstd)
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block */
+	memcpy(header,compression==BSDIFF_COMPRESS_ZSTD ?
+	    BSDIFF_MAGIC_ZSTD : BSDIFF_MAGIC_BZIP2,8);
+	offtout(0, header + 8);
+	offtout(0, header + 16);
+	offtout(newsize, header + 24);
+	if (fwrite(header, 32, 1, pf) != 1)
                 goto fail;
 
+	/*
+	 * The ctrl block goes straight into the patch file, the diff and
+	 * extra blocks are compressed into temporary files which are
+	 * appended to the patch file afterwards
+	 */
+	for(i=0;i<3;i++) {
+		blocks[i].ctx=&ctx;
+		blocks[i].type=i;
+		blocks[i].f=i==BSDIFF_BLOCK_CTRL ? pf : tmpfile();
+		blocks[i].compression=compression;
+		blocks[i].level=level;
+		if(blocks[i].f==NULL)
+			goto fail;
+	}
+	for(i=0;i<3;i++) {
+		if(block_open(&blocks[i])) {
+			blocks[i].rval=-1;
+			goto fail2;
+		}
+	}
+
+	if(ctx.spill) {
+		/* Scan and compress right here */
+		err=0;
+		for(i=0;i<ctx.nchunks && !err;i++) {
+			/* Spilling is accounted as compression time */
+			ts=bsdiff_now()-blocks_time(blocks);
+			scan_chunk(&ctx,&ctx.chunks[i]);
+			ctx.scan_time+=bsdiff_now()-blocks_time(blocks)-ts;
+			err=ctx.chunks[i].err ||
+			    chunk_spill(&ctx,&ctx.chunks[i]);
+		}
+		for(i=0;i<3;i++)
+			if(block_close(&blocks[i],err) && !err)
+				blocks[i].rval=-1;
+	} else {
+		/* Compressors first, they are needed for scanning to progress */
+		nthreads=0;
+		for(i=0;i<3;i++) {
+			if(pthread_create(&tids[nthreads],NULL,compress_block,
+			    &blocks[i])) {
+				blocks[i].rval=-1;
+				snprintf(blocks[i].errmsg,
+				    sizeof(blocks[i].errmsg),
+				    "Unable to create thread");
+				set_abort(&ctx);
+				break;
+			}
+			nthreads++;
+		}
+		for(i=0;i<threads-1 && nthreads>=3;i++) {
+			if(pthread_create(&tids[nthreads],NULL,scan_thread,
+			    &ctx))
+				break;
+			nthreads++;
+		}
+		scan_thread(&ctx);
+		for(i=0;i<nthreads;i++)
+			pthread_join(tids[i],NULL);
+	}
+
+	if(ctx.toolarge) {
+		rval=BSDIFF_TOO_LARGE;
+		goto cleanup;
+	}
+	for(i=0;i<3;i++)
+		if(blocks[i].rval)
+			goto fail2;
+	for(i=0;i<ctx.nchunks;i++) {
+		if(ctx.chunks[i].err) {
+			trace(LOG_ERR, "Unable to scan for bsdiff file %s -- "
+			    "Out of memory", patchfile);
+			goto cleanup;
+		}
+	}
+
+	if ((ctrllen = ftello(pf)) == -1)
+		goto fail;
+	if ((difflen = ftello(blocks[BSDIFF_BLOCK_DIFF].f)) == -1)
+		goto fail;
+	if (copy_file(pf, blocks[BSDIFF_BLOCK_DIFF].f) ||
+	    copy_file(pf, blocks[BSDIFF_BLOCK_EXTRA].f))
+		goto fail;
+
+	offtout(ctrllen-32, header + 8);
+	offtout(difflen, header + 16);
+
+	/* Output is only checked now and then, do a final check */
+	if ((patchsize = ftello(pf)) == -1)
+		goto fail;
+	if (ctx.maxsize && patchsize > ctx.maxsize) {
+		rval=BSDIFF_TOO_LARGE;
+		goto cleanup;
+	}
+
 	/* Seek to the beginning, write the header, and close the file */
 	if (fseeko(pf, 0, SEEK_SET))
                 goto fail;
 	if (fwrite(header, 32, 1, pf) != 1)
                 goto fail;
-	if (fclose(pf))
-                goto cleanup2;
-
-	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(I);
-
-	return 0;
-
+	rval=0;
+	goto cleanup;
 
 fail2:
-        trace(LOG_ERR, "Unable to write bsdiff file %s -- bz2err: %d",
-            patchfile, bz2err);
-
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+	for(i=0;i<3;i++)
+		if(blocks[i].rval)
+			trace(LOG_ERR, "Unable to write bsdiff file %s -- %s",
+			    patchfile, blocks[i].errmsg);
         goto cleanup;
 
 fail:
@@ -414,11 +1127,31 @@ fail:
             patchfile, strerror(errno));
 
 cleanup:
-        fclose(pf);
-cleanup2:
-	free(db);
-	free(eb);
-	free(I);
-        return -1;
+	for(i=0;i<3;i++)
+		block_close(&blocks[i],1);
+	if (fclose(pf) && rval == 0) {
+		trace(LOG_ERR, "Unable to write bsdiff file %s -- %s",
+		    patchfile, strerror(errno));
+		rval=-1;
+	}
+	for(i=1;i<3;i++)
+		if(blocks[i].f!=NULL)
+			fclose(blocks[i].f);
 
+	/* Free the memory we used */
+	for(i=0;i<ctx.nchunks && ctx.chunks!=NULL;i++)
+		chunk_free(&ctx.chunks[i]);
+	free(ctx.chunks);
+
+	if(opts != NULL && opts->stats != NULL) {
+		opts->stats->sort_time=t1;
+		opts->stats->scan_time=ctx.scan_time;
+		opts->stats->compress_time=blocks_time(blocks);
+		opts->stats->total_time=bsdiff_now()-t0;
+		opts->stats->kernels=K->name;
+	}
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.mutex);
+	sa_free(&I);
+	return rval;
 }
@@ -1,3 +1,45 @@
-int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
-                const char *patchfile);
+#pragma once
+
+#include <sys/types.h>
+
+#define BSDIFF_MAX_THREADS 64
+
+#define BSDIFF_COMPRESS_BZIP2 0   // Classic BSDIFF40
+#define BSDIFF_COMPRESS_ZSTD  1   // Same layout, zstd frames, "BSDZST40" magic
+
+#define BSDIFF_MAGIC_BZIP2 "BSDIFF40"
+#define BSDIFF_MAGIC_ZSTD  "BSDZST40"
 
+typedef struct bsdiff_stats {
+  double sort_time;      // Building (or loading) the suffix array
+  double scan_time;      // Time spent scanning, summed over all threads
+  double compress_time;  // Time spent compressing, summed over all blocks
+  double total_time;     // Wall clock time for the whole diff
+  const char *kernels;   // Inner loop implementation used
+} bsdiff_stats_t;
+
+typedef struct bsdiff_opts {
+  int threads;       // Threads used for scanning and compression
+  int compression;   // BSDIFF_COMPRESS_*
+  int level;         // zstd compression level, 0 for default
+  off_t maxsize;     // Give up if the patch exceeds this size, 0 for no limit
+  const char *sacache; // Suffix array cache file for 'old', or NULL
+  int sacache_store;   // Write the suffix array to 'sacache' if not there
+  bsdiff_stats_t *stats; // Filled in with timing information if not NULL
+} bsdiff_opts_t;
+
+#define BSDIFF_TOO_LARGE 1  // Returned when the patch exceeded opts->maxsize
+
+/**
+ * Generate a patch from 'old' to 'new' and store it in 'patchfile'
+ *
+ * With opts == NULL (or threads <= 1 and bzip2 compression) the output
+ * is identical to the original bsdiff. With more threads the new file
+ * is scanned in chunks in parallel, which yields a slightly different
+ * (but equally valid) patch.
+ *
+ * Returns 0 on success, BSDIFF_TOO_LARGE if generation was abandoned
+ * because of opts->maxsize and -1 on other errors.
+ */
+int make_bsdiff(u_char *old, off_t oldsize, u_char *new, off_t newsize,
+                const char *patchfile, const bsdiff_opts_t *opts);
@@ -0,0 +1,129 @@
+/*
+ * Vectorized bsdiff inner loops, instantiated by bsdiff.c once per
+ * instruction set
+ *
+ * Before inclusion the following must be defined:
+ *
+ *  SIMD_FN(x)         Mangle function names for this instruction set
+ *  SIMD_TARGET        Function attribute enabling the instruction set
+ *  SIMD_W             Vector width in bytes
+ *  SIMD_FULL          Mask with the lowest SIMD_W bits set
+ *  SIMD_EQMASK(a, b)  Bitmask of equal bytes among SIMD_W bytes at a and b
+ *  SIMD_SUB(d, a, b)  Store SIMD_W bytes of a - b at d
+ *
+ * All functions compute exactly the same thing as their scalar
+ * counterparts in bsdiff.c so the patch output does not depend on
+ * which set is used.
+ */
+
+
+SIMD_TARGET static off_t
+SIMD_FN(matchlen)(const u_char *old,off_t oldsize,
+    const u_char *new,off_t newsize)
+{
+	off_t i,n=MIN(oldsize,newsize);
+	uint32_t m;
+
+	for(i=0;i+SIMD_W<=n;i+=SIMD_W) {
+		m=~SIMD_EQMASK(old+i,new+i) & SIMD_FULL;
+		if(m)
+			return i+__builtin_ctz(m);
+	}
+	for(;i<n;i++)
+		if(old[i]!=new[i]) break;
+	return i;
+}
+
+SIMD_TARGET static off_t
+SIMD_FN(count_eq)(const u_char *a,const u_char *b,off_t n)
+{
+	off_t i,r=0;
+
+	for(i=0;i+SIMD_W<=n;i+=SIMD_W)
+		r+=__builtin_popcount(SIMD_EQMASK(a+i,b+i));
+	for(;i<n;i++)
+		if(a[i]==b[i]) r++;
+	return r;
+}
+
+SIMD_TARGET static void
+SIMD_FN(sub)(u_char *d,const u_char *a,const u_char *b,off_t n)
+{
+	off_t i;
+
+	for(i=0;i+SIMD_W<=n;i+=SIMD_W)
+		SIMD_SUB(d+i,a+i,b+i);
+	for(;i<n;i++)
+		d[i]=a[i]-b[i];
+}
+
+/*
+ * The score after i bytes is 2 * matches - i, so within a vector it
+ * can grow by at most the number of matching bytes in it. Vectors
+ * that can't beat the best score so far are skipped in one go, as
+ * are vectors that match completely (the score peaks at their end).
+ * Only the rest is scored byte by byte.
+ */
+SIMD_TARGET static off_t
+SIMD_FN(extend_fwd)(const u_char *old,const u_char *new,off_t n)
+{
+	off_t i=0,s=0,Sf=0,lenf=0;
+	uint32_t m;
+	int k;
+
+	while(i+SIMD_W<=n) {
+		m=SIMD_EQMASK(old+i,new+i);
+		if(m==SIMD_FULL) {
+			s+=SIMD_W;
+			i+=SIMD_W;
+			if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+		} else if(s*2-i+__builtin_popcount(m)<=Sf*2-lenf) {
+			s+=__builtin_popcount(m);
+			i+=SIMD_W;
+		} else {
+			for(k=0;k<SIMD_W;k++) {
+				if(m&(1U<<k)) s++;
+				i++;
+				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+			}
+		}
+	}
+	while(i<n) {
+		if(old[i]==new[i]) s++;
+		i++;
+		if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+	}
+	return lenf;
+}
+
+/* Same as above but walking backwards from (not including) old and new */
+SIMD_TARGET static off_t
+SIMD_FN(extend_bwd)(const u_char *old,const u_char *new,off_t n)
+{
+	off_t i=1,s=0,Sb=0,lenb=0;
+	uint32_t m;
+	int k;
+
+	while(i+SIMD_W-1<=n) {
+		/* Bit SIMD_W - k is byte -(i + k - 1) */
+		m=SIMD_EQMASK(old-i-SIMD_W+1,new-i-SIMD_W+1);
+		if(m==SIMD_FULL) {
+			s+=SIMD_W;
+			i+=SIMD_W;
+			if(s*2-(i-1)>Sb*2-lenb) { Sb=s; lenb=i-1; };
+		} else if(s*2-(i-1)+__builtin_popcount(m)<=Sb*2-lenb) {
+			s+=__builtin_popcount(m);
+			i+=SIMD_W;
+		} else {
+			for(k=1;k<=SIMD_W;k++,i++) {
+				if(m&(1U<<(SIMD_W-k))) s++;
+				if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+			}
+		}
+	}
+	for(;i<=n;i++) {
+		if(old[-i]==new[-i]) s++;
+		if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+	}
+	return lenb;
+}
@@ -94,20 +94,13 @@ typedef struct project_doozer_conf {
 static int
 get_pdc(project_t *p, const ref_t *r, project_doozer_conf_t *pdc)
 {
-  void *data;
   char errbuf[512];
 
   const char *fname = ".doozer.json";
 
-  if(git_get_file(p, &r->oid, fname, &data, NULL, errbuf, sizeof(errbuf))) {
-    plog(p, "build/check", "No '%s' found in '%s' (%s) -- %s",
-         fname, r->name, r->oidtxt, errbuf);
-    return -1;
-  }
-
-  htsmsg_t *doc = htsmsg_json_deserialize(data, errbuf, sizeof(errbuf));
+  htsmsg_t *doc = git_get_json(p, &r->oid, fname, errbuf, sizeof(errbuf));
   if(doc == NULL) {
-    plog(p, "build/check", "Unable to decode '%s' from ref '%s' (%s) -- %s",
+    plog(p, "build/check", "Unable to load '%s' from ref '%s' (%s) -- %s",
          fname, r->name, r->oidtxt, errbuf);
     return -1;
   }
@@ -116,6 +109,7 @@ get_pdc(project_t *p, const ref_t *r, project_doozer_conf_t *pdc)
   if(targets == NULL) {
     plog(p, "build/check", "'%s' Contains no 'targets' in '%s' (%s)",
          fname, r->name, r->oidtxt);
+    htsmsg_destroy(doc);
     return -1;
   }
 
@@ -158,10 +152,14 @@ get_pdc(project_t *p, const ref_t *r, project_doozer_conf_t *pdc)
  *
  */
 int
-buildmaster_check_for_builds(project_t *p)
+buildmaster_check_for_builds(project_t *p, const char *branch)
 {
   int retval = 0;
-  plog(p, "build/check", "Checking if need to build anything");
+  if(branch != NULL)
+    plog(p, "build/check", "Checking if need to build anything in %s",
+         branch);
+  else
+    plog(p, "build/check", "Checking if need to build anything");
 
   project_cfg(pc, p->p_id);
   if(pc == NULL)
@@ -177,11 +175,15 @@ buildmaster_check_for_builds(project_t *p)
   if(c == NULL)
     return DOOZER_ERROR_TRANSIENT;
 
-  struct ref_list refs;
-  git_repo_list_branches(p, &refs);
-  ref_t *b;
+  scoped_ref_snapshot(rs, p);
+  if(rs == NULL)
+    return DOOZER_ERROR_TRANSIENT;
+
+  for(int i = 0; i < rs->rs_count; i++) {
+    const ref_t *b = &rs->rs_refs[i];
+    if(branch != NULL && strcmp(b->name, branch))
+      continue;
 
-  LIST_FOREACH(b, &refs, link) {
     cfg_t *bc = find_branch_config(p, bmconf, b->name);
     if(bc == NULL)
       continue;
@@ -233,7 +235,6 @@ buildmaster_check_for_builds(project_t *p)
                 pdc.pdc_targets[i].tc_buildenv, "Automatic build");
     }
   }
-  git_repo_free_refs(&refs);
   return retval;
 }
 
@@ -545,7 +546,10 @@ http_artifact(http_connection_t *hc, int argc, char **argv, int flags)
      hc->hc_post_len == 0)
     return 400;
 
-  int origsize = origsizetxt ? atoi(origsizetxt) : 0;
+  // Multi-GB artifacts don't fit an int, bind it as text
+  char origsize[32];
+  snprintf(origsize, sizeof(origsize), "%lld",
+           origsizetxt ? strtoll(origsizetxt, NULL, 10) : 0LL);
   int jobid = atoi(jobidstr);
 
   if(hc->hc_cmd != HTTP_CMD_PUT)
@@ -655,7 +659,7 @@ http_artifact(http_connection_t *hc, int argc, char **argv, int flags)
              bucket, redir_path, sig, expire, awsid);
     http_redirect(hc, location, HTTP_STATUS_TEMPORARY_REDIRECT);
 
-    db_stmt_exec(s, "issssissssi",
+    db_stmt_exec(s, "issssisssss",
                  jobid,
                  type,
                  redir_path,
@@ -736,7 +740,7 @@ http_artifact(http_connection_t *hc, int argc, char **argv, int flags)
 
     snprintf(path, sizeof(path), "%d/%s", jobid, name);
 
-    db_stmt_exec(s, "issssissssi",
+    db_stmt_exec(s, "issssisssss",
                  jobid,
                  type,
                  path,
@@ -755,7 +759,7 @@ http_artifact(http_connection_t *hc, int argc, char **argv, int flags)
 
   } else {
 
-    db_stmt_exec(s, "isbssissssi",
+    db_stmt_exec(s, "isbssisssss",
                  jobid,
                  type,
                  hc->hc_post_data, hc->hc_post_len,
@@ -1118,30 +1122,20 @@ buildmaster_add_build(const char *project, const char *branch,
     return 1;
   }
 
-  struct ref_list refs;
-  git_repo_list_branches(p, &refs);
-  ref_t *r;
-  LIST_FOREACH(r, &refs, link) {
-    if(!strcmp(branch, r->name))
-      break;
-  }
+  scoped_ref_snapshot(rs, p);
+  const ref_t *r = rs != NULL ? ref_snapshot_find(rs, branch) : NULL;
 
   if(r == NULL) {
     msg(opaque, "No such branch");
-    goto bad;
+    return 1;
   }
 
 
   if(add_build(p, r->oidtxt, target, buildenv, reason)) {
     msg(opaque, "Failed to enqueue build");
-    goto bad;
+    return 1;
   }
-  git_repo_free_refs(&refs);
   return 0;
-
- bad:
-  git_repo_free_refs(&refs);
-  return 1;
 }
 
 /**
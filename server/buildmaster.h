@@ -2,7 +2,7 @@
 
 #include "project.h"
 
-int buildmaster_check_for_builds(project_t *p);
+int buildmaster_check_for_builds(project_t *p, const char *branch);
 
 void buildmaster_init(void);
 
@@ -0,0 +1,385 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "libsvc/trace.h"
+
+#include "describecache.h"
+
+/**
+ * Memoized git_describe() results, commit OID -> (nearest tag, distance)
+ *
+ * Results are kept in memory until describecache_save() merges them
+ * into a file which is then mapped read-only. The file holds entries
+ * sorted by OID followed by a table of NUL terminated tag names:
+ *
+ *   header | entry[count] | names[namesize]
+ *
+ * All results depend on the set of tags, so the cache is tied to a
+ * fingerprint of them and silently emptied when it changes.
+ */
+
+#define DC_MAGIC     "DZDESC01"
+#define DC_HASHSIZE  1024
+#define DC_NO_TAG    UINT32_MAX
+
+typedef struct dc_file_header {
+  char magic[8];
+  uint64_t tagfp;
+  uint32_t count;
+  uint32_t namesize;
+} dc_file_header_t;
+
+typedef struct dc_file_entry {
+  uint8_t oid[GIT_OID_RAWSZ];
+  uint32_t tag;        // Offset in names, DC_NO_TAG if none
+  uint32_t distance;
+} dc_file_entry_t;
+
+LIST_HEAD(dc_entry_list, dc_entry);
+
+typedef struct dc_entry {
+  LIST_ENTRY(dc_entry) de_link;
+  git_oid de_oid;
+  char *de_tag;
+  int de_distance;
+} dc_entry_t;
+
+struct describe_cache {
+  char *dc_path;
+  uint64_t dc_tagfp;
+
+  struct dc_entry_list dc_hash[DC_HASHSIZE];
+  int dc_dirty;
+
+  void *dc_map;
+  size_t dc_maplen;
+  const dc_file_entry_t *dc_entries;
+  uint32_t dc_count;
+  const char *dc_names;
+  uint32_t dc_namesize;
+};
+
+
+/**
+ *
+ */
+static struct dc_entry_list *
+dc_bucket(describe_cache_t *dc, const git_oid *oid)
+{
+  return &dc->dc_hash[(oid->id[0] | oid->id[1] << 8) & (DC_HASHSIZE - 1)];
+}
+
+
+/**
+ *
+ */
+static void
+dc_unmap(describe_cache_t *dc)
+{
+  if(dc->dc_map != NULL)
+    munmap(dc->dc_map, dc->dc_maplen);
+  dc->dc_map = NULL;
+  dc->dc_entries = NULL;
+  dc->dc_count = 0;
+  dc->dc_names = NULL;
+  dc->dc_namesize = 0;
+}
+
+
+/**
+ *
+ */
+static void
+dc_flush_memory(describe_cache_t *dc)
+{
+  dc_entry_t *de;
+  for(int i = 0; i < DC_HASHSIZE; i++) {
+    while((de = LIST_FIRST(&dc->dc_hash[i])) != NULL) {
+      LIST_REMOVE(de, de_link);
+      free(de->de_tag);
+      free(de);
+    }
+  }
+  dc->dc_dirty = 0;
+}
+
+
+/**
+ *
+ */
+static void
+dc_map(describe_cache_t *dc)
+{
+  struct stat st;
+  int fd = open(dc->dc_path, O_RDONLY);
+  if(fd == -1)
+    return;
+
+  if(fstat(fd, &st) || st.st_size < sizeof(dc_file_header_t)) {
+    close(fd);
+    return;
+  }
+
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED)
+    return;
+
+  const dc_file_header_t *h = p;
+
+  if(memcmp(h->magic, DC_MAGIC, 8) || h->tagfp != dc->dc_tagfp ||
+     st.st_size != sizeof(dc_file_header_t) +
+     (off_t)h->count * sizeof(dc_file_entry_t) + h->namesize ||
+     (h->namesize && ((const char *)p)[st.st_size - 1] != 0)) {
+    // Stale (tags have changed) or broken
+    munmap(p, st.st_size);
+    return;
+  }
+
+  // Lookups binary search the entries and return tags straight out of
+  // the names table, so make sure both are sane before using the file
+
+  const dc_file_entry_t *e = (const void *)(h + 1);
+  for(uint32_t i = 0; i < h->count; i++) {
+    if((e[i].tag != DC_NO_TAG && e[i].tag >= h->namesize) ||
+       (i > 0 && memcmp(e[i - 1].oid, e[i].oid, GIT_OID_RAWSZ) >= 0)) {
+      trace(LOG_WARNING, "Describe cache %s is corrupt, discarding",
+            dc->dc_path);
+      munmap(p, st.st_size);
+      unlink(dc->dc_path);
+      return;
+    }
+  }
+
+  dc->dc_map = p;
+  dc->dc_maplen = st.st_size;
+  dc->dc_entries = (const void *)(h + 1);
+  dc->dc_count = h->count;
+  dc->dc_names = (const char *)(dc->dc_entries + h->count);
+  dc->dc_namesize = h->namesize;
+}
+
+
+/**
+ * Open the cache stored at 'path' (or return 'dc' as is) making sure
+ * it's valid for the tags fingerprinted by 'tagfp'
+ */
+describe_cache_t *
+describecache_open(describe_cache_t *dc, const char *path, uint64_t tagfp)
+{
+  if(dc != NULL) {
+    if(dc->dc_tagfp == tagfp)
+      return dc;
+    dc_unmap(dc);
+    dc_flush_memory(dc);
+    dc->dc_tagfp = tagfp;
+    return dc;
+  }
+
+  dc = calloc(1, sizeof(describe_cache_t));
+  dc->dc_path = strdup(path);
+  dc->dc_tagfp = tagfp;
+  dc_map(dc);
+  return dc;
+}
+
+
+/**
+ * The returned tag is valid until the next describecache_open() or
+ * describecache_save()
+ */
+int
+describecache_get(describe_cache_t *dc, const git_oid *oid,
+                  const char **tagp, int *distancep)
+{
+  dc_entry_t *de;
+
+  LIST_FOREACH(de, dc_bucket(dc, oid), de_link) {
+    if(!git_oid_cmp(&de->de_oid, oid)) {
+      *tagp = de->de_tag;
+      *distancep = de->de_distance;
+      return 0;
+    }
+  }
+
+  uint32_t lo = 0, hi = dc->dc_count;
+  while(lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const dc_file_entry_t *e = &dc->dc_entries[mid];
+    int c = memcmp(e->oid, oid->id, GIT_OID_RAWSZ);
+    if(c == 0) {
+      *tagp = e->tag == DC_NO_TAG ? NULL : dc->dc_names + e->tag;
+      *distancep = e->distance;
+      return 0;
+    }
+    if(c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+void
+describecache_put(describe_cache_t *dc, const git_oid *oid,
+                  const char *tag, int distance)
+{
+  dc_entry_t *de = calloc(1, sizeof(dc_entry_t));
+  git_oid_cpy(&de->de_oid, oid);
+  de->de_tag = tag ? strdup(tag) : NULL;
+  de->de_distance = distance;
+  LIST_INSERT_HEAD(dc_bucket(dc, oid), de, de_link);
+  dc->dc_dirty++;
+}
+
+
+typedef struct dc_save_entry {
+  const uint8_t *oid;
+  const char *tag;
+  uint32_t distance;
+  uint32_t tagoffset;
+} dc_save_entry_t;
+
+
+/**
+ *
+ */
+static int
+dc_save_tagcmp(const void *A, const void *B)
+{
+  const dc_save_entry_t *a = A, *b = B;
+  if(a->tag == NULL || b->tag == NULL)
+    return (a->tag != NULL) - (b->tag != NULL);
+  return strcmp(a->tag, b->tag);
+}
+
+
+/**
+ *
+ */
+static int
+dc_save_oidcmp(const void *A, const void *B)
+{
+  const dc_save_entry_t *a = A, *b = B;
+  return memcmp(a->oid, b->oid, GIT_OID_RAWSZ);
+}
+
+
+/**
+ * Merge results added since the last save into the file
+ */
+void
+describecache_save(describe_cache_t *dc)
+{
+  dc_entry_t *de;
+  char tmppath[PATH_MAX];
+
+  if(!dc->dc_dirty)
+    return;
+
+  size_t count = dc->dc_count + dc->dc_dirty;
+  dc_save_entry_t *v = malloc(count * sizeof(dc_save_entry_t));
+  size_t n = 0;
+
+  for(uint32_t i = 0; i < dc->dc_count; i++) {
+    const dc_file_entry_t *e = &dc->dc_entries[i];
+    v[n].oid = e->oid;
+    v[n].tag = e->tag == DC_NO_TAG ? NULL : dc->dc_names + e->tag;
+    v[n].distance = e->distance;
+    n++;
+  }
+
+  for(int i = 0; i < DC_HASHSIZE; i++) {
+    LIST_FOREACH(de, &dc->dc_hash[i], de_link) {
+      v[n].oid = de->de_oid.id;
+      v[n].tag = de->de_tag;
+      v[n].distance = de->de_distance;
+      n++;
+    }
+  }
+
+  // Group by tag so each name is only stored once
+
+  qsort(v, n, sizeof(dc_save_entry_t), dc_save_tagcmp);
+
+  size_t namesize = 0;
+  for(size_t i = 0; i < n; i++) {
+    if(v[i].tag == NULL) {
+      v[i].tagoffset = DC_NO_TAG;
+    } else if(i > 0 && v[i - 1].tag != NULL &&
+              !strcmp(v[i - 1].tag, v[i].tag)) {
+      v[i].tagoffset = v[i - 1].tagoffset;
+    } else {
+      v[i].tagoffset = namesize;
+      namesize += strlen(v[i].tag) + 1;
+    }
+  }
+
+  char *names = malloc(namesize ?: 1);
+  for(size_t i = 0; i < n; i++)
+    if(v[i].tag != NULL)
+      strcpy(names + v[i].tagoffset, v[i].tag);
+
+  qsort(v, n, sizeof(dc_save_entry_t), dc_save_oidcmp);
+
+  dc_file_entry_t *entries = malloc(n * sizeof(dc_file_entry_t) ?: 1);
+  for(size_t i = 0; i < n; i++) {
+    memcpy(entries[i].oid, v[i].oid, GIT_OID_RAWSZ);
+    entries[i].tag = v[i].tagoffset;
+    entries[i].distance = v[i].distance;
+  }
+  free(v);
+
+  dc_file_header_t h = {};
+  memcpy(h.magic, DC_MAGIC, 8);
+  h.tagfp = dc->dc_tagfp;
+  h.count = n;
+  h.namesize = namesize;
+
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", dc->dc_path);
+
+  int err = 0;
+  FILE *fp = fopen(tmppath, "wb");
+  if(fp == NULL) {
+    err = errno;
+  } else {
+    if(fwrite(&h, sizeof(h), 1, fp) != 1 ||
+       (n && fwrite(entries, sizeof(dc_file_entry_t), n, fp) != n) ||
+       (namesize && fwrite(names, namesize, 1, fp) != 1))
+      err = errno ?: EIO;
+    if(fclose(fp) && !err)
+      err = errno;
+    if(!err && rename(tmppath, dc->dc_path))
+      err = errno;
+    if(err)
+      unlink(tmppath);
+  }
+
+  free(entries);
+  free(names);
+
+  if(err) {
+    trace(LOG_ERR, "Unable to save describe cache %s -- %s",
+          dc->dc_path, strerror(err));
+    return;
+  }
+
+  dc_unmap(dc);
+  dc_flush_memory(dc);
+  dc_map(dc);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <git2.h>
+
+typedef struct describe_cache describe_cache_t;
+
+describe_cache_t *describecache_open(describe_cache_t *dc, const char *path,
+                                     uint64_t tagfp);
+
+int describecache_get(describe_cache_t *dc, const git_oid *oid,
+                      const char **tagp, int *distancep);
+
+void describecache_put(describe_cache_t *dc, const git_oid *oid,
+                       const char *tag, int distance);
+
+void describecache_save(describe_cache_t *dc);
@@ -1,47 +1,64 @@
+#include <sys/param.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 
 #include "doozer.h"
 #include "git.h"
+#include "describecache.h"
 #include "libsvc/threading.h"
 #include "libsvc/misc.h"
 #include "libsvc/talloc.h"
+#include "libsvc/htsmsg_json.h"
+
+static void describe_refresh(project_t *p);
 
 /**
- * Must be called with lock held
- * Return 0 if repo exists and is usable
+ * Return 0 if path of the repo could be figured out
  */
 static int
-ensure_repo(project_t *p)
+repo_path(project_t *p, char *path, size_t pathlen)
 {
-  const char *repo;
-
-  if(p->p_repo != NULL)
-    return 0;
-
   project_cfg(pc, p->p_id);
-  if(pc == NULL) {
-    plog(p, "git/repo", "Unable to open GIT repo -- No project config");
-    return DOOZER_ERROR_PERMANENT;
-  }
+  if(pc == NULL)
+    return -1;
 
-  repo = cfg_get_str(pc, CFG("repo"), NULL);
+  const char *repo = cfg_get_str(pc, CFG("repo"), NULL);
 
   if(repo == NULL) {
     cfg_root(root);
 
-    char path[512];
-    if(p->p_repo != NULL)
-      return 0;
-
     const char *repos = cfg_get_str(root, CFG("repos"),
 				    "/var/tmp/doozer-git-repos");
 
-    snprintf(path, sizeof(path), "%s/%s", repos, p->p_id);
+    snprintf(path, pathlen, "%s/%s", repos, p->p_id);
+  } else {
+    snprintf(path, pathlen, "%s", repo);
+  }
+  return 0;
+}
+
+
+/**
+ * Must be called with lock held
+ * Return 0 if repo exists and is usable
+ */
+static int
+ensure_repo(project_t *p)
+{
+  char repo[512];
+
+  if(p->p_repo != NULL)
+    return 0;
 
-    repo = path;
+  if(repo_path(p, repo, sizeof(repo))) {
+    plog(p, "git/repo", "Unable to open GIT repo -- No project config");
+    return DOOZER_ERROR_PERMANENT;
   }
 
   int r;
@@ -64,6 +81,339 @@ ensure_repo(project_t *p)
 }
 
 
+/**
+ * Borrow a repo handle for read-only access
+ *
+ * Each handle is only used by one thread at a time but there are
+ * several of them (config: gitReaders), so lookups can run in parallel
+ * with each other and with the network part of git_repo_sync(). The
+ * refs are not updated while any reader is held.
+ *
+ * Readers must not be nested. 'repo' is NULL if the repo can't be
+ * opened (typically because it has not been synced yet)
+ */
+git_reader_t
+git_reader_acquire(project_t *p)
+{
+  git_reader_t gr = {p, NULL};
+  char path[512];
+
+  pthread_rwlock_rdlock(&p->p_refs_lock);
+  pthread_mutex_lock(&p->p_reader_mutex);
+
+  while(p->p_num_free_readers == 0) {
+    cfg_root(root);
+    int max = cfg_get_int(root, CFG("gitReaders"), 4);
+    max = MAX(MIN(max, PROJECT_GIT_READERS_MAX), 1);
+
+    if(p->p_num_readers < max) {
+      p->p_num_readers++;
+      pthread_mutex_unlock(&p->p_reader_mutex);
+
+      if(!repo_path(p, path, sizeof(path)) &&
+         git_repository_open_bare(&gr.repo, path) >= 0)
+        return gr;
+
+      pthread_mutex_lock(&p->p_reader_mutex);
+      p->p_num_readers--;
+      pthread_cond_signal(&p->p_reader_cond);
+      pthread_mutex_unlock(&p->p_reader_mutex);
+      pthread_rwlock_unlock(&p->p_refs_lock);
+      return gr;
+    }
+    pthread_cond_wait(&p->p_reader_cond, &p->p_reader_mutex);
+  }
+
+  gr.repo = p->p_readers[--p->p_num_free_readers];
+  pthread_mutex_unlock(&p->p_reader_mutex);
+  return gr;
+}
+
+
+/**
+ *
+ */
+void
+git_reader_release(git_reader_t *gr)
+{
+  project_t *p = gr->p;
+
+  if(gr->repo == NULL)
+    return;
+
+  pthread_mutex_lock(&p->p_reader_mutex);
+  p->p_readers[p->p_num_free_readers++] = gr->repo;
+  pthread_cond_signal(&p->p_reader_cond);
+  pthread_mutex_unlock(&p->p_reader_mutex);
+  pthread_rwlock_unlock(&p->p_refs_lock);
+  gr->repo = NULL;
+}
+
+
+
+/**
+ * Tags indexed by the OID they point to (peeled one level, same as
+ * tag_list_callback()) so describe and changelog can look up commits
+ * in O(1) instead of scanning all tags for every commit walked.
+ *
+ * Built on first use and then kept up to date by update_cb().
+ * Protected by p_cache_mutex
+ */
+#define TAG_HASH_SIZE 1024
+
+typedef struct tag {
+  LIST_ENTRY(tag) t_link;
+  char *t_name;
+  git_oid t_target;
+} tag_t;
+
+LIST_HEAD(tag_list, tag);
+
+typedef struct tag_index {
+  int ti_refcount;
+  struct tag_list ti_hash[TAG_HASH_SIZE];
+  uint64_t ti_fingerprint;  // Sum of tag_hash() of all tags
+} tag_index_t;
+
+
+/**
+ *
+ */
+static struct tag_list *
+tag_index_bucket(tag_index_t *ti, const git_oid *oid)
+{
+  return &ti->ti_hash[(oid->id[0] | oid->id[1] << 8) & (TAG_HASH_SIZE - 1)];
+}
+
+
+/**
+ * FNV-1a of name and target, summed up so the fingerprint does not
+ * depend on the order tags are added and removed
+ */
+static uint64_t
+tag_hash(const tag_t *t)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for(const char *s = t->t_name; *s; s++)
+    h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+  for(int i = 0; i < GIT_OID_RAWSZ; i++)
+    h = (h ^ t->t_target.id[i]) * 1099511628211ULL;
+  return h;
+}
+
+
+/**
+ *
+ */
+static void
+tag_index_add(tag_index_t *ti, const char *name, const git_oid *target)
+{
+  tag_t *t = calloc(1, sizeof(tag_t));
+  t->t_name = strdup(name);
+  git_oid_cpy(&t->t_target, target);
+  LIST_INSERT_HEAD(tag_index_bucket(ti, &t->t_target), t, t_link);
+  ti->ti_fingerprint += tag_hash(t);
+}
+
+
+/**
+ *
+ */
+static void
+tag_index_insert(tag_index_t *ti, git_repository *repo,
+                 const char *name, const git_oid *oid)
+{
+  git_tag *tag;
+  name += strlen("refs/tags/");
+
+  if(!git_tag_lookup(&tag, repo, oid)) {
+    tag_index_add(ti, name, git_tag_target_id(tag));
+    git_tag_free(tag);
+  } else {
+    tag_index_add(ti, name, oid);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+tag_index_release(tag_index_t *ti)
+{
+  tag_t *t;
+
+  if(__sync_sub_and_fetch(&ti->ti_refcount, 1))
+    return;
+
+  for(int i = 0; i < TAG_HASH_SIZE; i++) {
+    while((t = LIST_FIRST(&ti->ti_hash[i])) != NULL) {
+      LIST_REMOVE(t, t_link);
+      free(t->t_name);
+      free(t);
+    }
+  }
+  free(ti);
+}
+
+
+/**
+ * Returns a private copy of 'ti' if anyone else is holding on to it.
+ * The index is immutable while borrowed.
+ *
+ * Must be called with p_cache_mutex held
+ */
+static tag_index_t *
+tag_index_unshare(tag_index_t *ti)
+{
+  tag_t *t;
+
+  if(ti->ti_refcount == 1)
+    return ti;
+
+  tag_index_t *copy = calloc(1, sizeof(tag_index_t));
+  copy->ti_refcount = 1;
+  for(int i = 0; i < TAG_HASH_SIZE; i++)
+    LIST_FOREACH(t, &ti->ti_hash[i], t_link)
+      tag_index_add(copy, t->t_name, &t->t_target);
+
+  tag_index_release(ti);
+  return copy;
+}
+
+
+/**
+ *
+ */
+static void
+tag_index_remove(tag_index_t *ti, const char *name)
+{
+  tag_t *t;
+  name += strlen("refs/tags/");
+
+  for(int i = 0; i < TAG_HASH_SIZE; i++) {
+    LIST_FOREACH(t, &ti->ti_hash[i], t_link) {
+      if(!strcmp(t->t_name, name)) {
+        ti->ti_fingerprint -= tag_hash(t);
+        LIST_REMOVE(t, t_link);
+        free(t->t_name);
+        free(t);
+        return;
+      }
+    }
+  }
+}
+
+
+/**
+ *
+ */
+struct tag_index_aux {
+  git_repository *repo;
+  tag_index_t *ti;
+};
+
+
+/**
+ *
+ */
+static int
+tag_index_callback(const char *name, git_oid *oid, void *payload)
+{
+  struct tag_index_aux *aux = payload;
+  tag_index_insert(aux->ti, aux->repo, name, oid);
+  return 0;
+}
+
+
+/**
+ * Must be called with p_cache_mutex held
+ */
+static tag_index_t *
+tag_index_get(project_t *p, git_repository *repo)
+{
+  if(p->p_tag_index == NULL) {
+    struct tag_index_aux aux = {repo, calloc(1, sizeof(tag_index_t))};
+    aux.ti->ti_refcount = 1;
+    git_tag_foreach(repo, &tag_index_callback, &aux);
+    p->p_tag_index = aux.ti;
+  }
+  return p->p_tag_index;
+}
+
+
+/**
+ * Borrow the tag index for use without p_cache_mutex held,
+ * give it back with tag_index_release()
+ *
+ * Must be called with p_cache_mutex held
+ */
+static tag_index_t *
+tag_index_acquire(project_t *p, git_repository *repo)
+{
+  tag_index_t *ti = tag_index_get(p, repo);
+  __sync_add_and_fetch(&ti->ti_refcount, 1);
+  return ti;
+}
+
+
+/**
+ * Returns the name of the tag pointing to 'oid' or NULL if none
+ */
+static const char *
+tag_index_find(tag_index_t *ti, const git_oid *oid)
+{
+  tag_t *t;
+
+  LIST_FOREACH(t, tag_index_bucket(ti, oid), t_link)
+    if(!git_oid_cmp(&t->t_target, oid))
+      return t->t_name;
+  return NULL;
+}
+
+
+/**
+ * Returns a fingerprint of all tags, it changes whenever any tag does
+ */
+uint64_t
+git_repo_tags_fingerprint(project_t *p)
+{
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return 0;
+
+  scoped_lock(&p->p_cache_mutex);
+  return tag_index_get(p, gr.repo)->ti_fingerprint;
+}
+
+
+/**
+ * Passed to update_cb()
+ */
+typedef struct sync_aux {
+  project_t *p;
+  int jobs;     // Jobs to schedule if any ref is updated
+  int updated;
+} sync_aux_t;
+
+
+/**
+ * Must be called with p_refs_lock held exclusively
+ */
+static void
+refs_changed(project_t *p)
+{
+  p->p_refs_generation++;
+
+  pthread_mutex_lock(&p->p_branches_mutex);
+  ref_snapshot_t *rs = p->p_branches;
+  p->p_branches = NULL;
+  pthread_mutex_unlock(&p->p_branches_mutex);
+
+  if(rs != NULL)
+    ref_snapshot_release(rs);
+}
+
 
 /**
  *
@@ -71,7 +421,8 @@ ensure_repo(project_t *p)
 static int
 update_cb(const char *refname, const git_oid *a, const git_oid *b, void *data)
 {
-  project_t *p = data;
+  sync_aux_t *aux = data;
+  project_t *p = aux->p;
   char a_str[GIT_OID_HEXSZ+1], b_str[GIT_OID_HEXSZ+1];
 
   git_oid_fmt(b_str, b);
@@ -88,10 +439,17 @@ update_cb(const char *refname, const git_oid *a, const git_oid *b, void *data)
          a_str, b_str, refname);
   }
 
-  project_schedule_job(p,
-                       PROJECT_JOB_CHECK_FOR_BUILDS |
-                       PROJECT_JOB_NOTIFY_REPO_UPDATE |
-                       PROJECT_JOB_GENERATE_RELEASES);
+  if(p->p_tag_index != NULL && !strncmp(refname, "refs/tags/", 10)) {
+    scoped_lock(&p->p_cache_mutex);
+    p->p_tag_index = tag_index_unshare(p->p_tag_index);
+    tag_index_remove(p->p_tag_index, refname);
+    if(!git_oid_iszero(b))
+      tag_index_insert(p->p_tag_index, p->p_repo, refname, b);
+  }
+
+  refs_changed(p);
+  aux->updated++;
+  project_schedule_job(p, aux->jobs);
   return 0;
 }
 
@@ -176,17 +534,150 @@ cred_acquire_cb(git_cred **out,
 }
 
 /**
+ * Compare the tips advertised by the remote with our own refs
  *
+ * Returns 1 if anything we would fetch differs, 0 if we're up to date
  */
-int
-git_repo_sync(project_t *p)
+static int
+remote_has_changes(project_t *p, git_remote *r)
 {
-  scoped_lock(&p->p_repo_mutex);
+  const git_remote_head **heads;
+  size_t nheads;
+  char localname[1024];
+  git_oid local;
+
+  if(git_remote_ls(&heads, &nheads, r) < 0)
+    return 1;
+
+  const size_t nspecs = git_remote_refspec_count(r);
+
+  for(size_t i = 0; i < nheads; i++) {
+    const char *name = heads[i]->name;
+    int matched = 0;
+
+    if(strncmp(name, "refs/", 5) || strstr(name, "^{}") != NULL)
+      continue;
+
+    for(size_t j = 0; j < nspecs; j++) {
+      const git_refspec *spec = git_remote_get_refspec(r, j);
+      if(!git_refspec_src_matches(spec, name))
+        continue;
+      matched = 1;
+      if(git_refspec_transform(localname, sizeof(localname), spec, name) ||
+         git_reference_name_to_id(&local, p->p_repo, localname) ||
+         git_oid_cmp(&local, &heads[i]->oid))
+        return 1;
+    }
 
-  int retval;
-  if((retval = ensure_repo(p)))
-    return retval;
+    // Tags are followed automatically even if not in the refspecs
+    if(!matched && !strncmp(name, "refs/tags/", 10) &&
+       (git_reference_name_to_id(&local, p->p_repo, name) ||
+        git_oid_cmp(&local, &heads[i]->oid)))
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+branch_in_list(cfg_t *list, const char *key, const char *branch)
+{
+  if(list == NULL)
+    return 0;
+
+  htsmsg_field_t *f;
+  HTSMSG_FOREACH(f, list) {
+    htsmsg_t *m = htsmsg_get_map_by_field(f);
+    if(m == NULL)
+      continue;
+
+    const char *pattern = htsmsg_get_str(m, key);
+    if(pattern != NULL && !fnmatch(pattern, branch, FNM_PATHNAME))
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Return 1 if 'refname' is something we make use of: Branches we build
+ * or release from, tags and changelog notes
+ */
+static int
+ref_is_wanted(cfg_t *pc, const char *refname)
+{
+  if(!strncmp(refname, "refs/tags/", strlen("refs/tags/")))
+    return 1;
+
+  if(!fnmatch("refs/notes/changelog*", refname, FNM_PATHNAME))
+    return 1;
+
+  if(strncmp(refname, "refs/heads/", strlen("refs/heads/")))
+    return 0;
+
+  const char *branch = refname + strlen("refs/heads/");
+
+  cfg_t *bmconf = cfg_get_map(pc, "buildmaster");
+  if(bmconf != NULL &&
+     branch_in_list(cfg_get_list(bmconf, "branches"), "pattern", branch))
+    return 1;
+
+  cfg_t *rtconf = cfg_get_map(pc, "releaseTracks");
+  if(rtconf != NULL &&
+     branch_in_list(cfg_get_list(rtconf, "tracks"), "branch", branch))
+    return 1;
+
+  return 0;
+}
+
+
+/**
+ * Replace the refspecs of 'r' with one for each wanted ref advertised
+ * by the remote. Branch patterns are fnmatch() globs which a refspec
+ * can't express, so they are resolved against what the remote has.
+ */
+static int
+remote_want_refs(cfg_t *pc, git_remote *r)
+{
+  const git_remote_head **heads;
+  size_t nheads;
+  char refspec[1024];
+
+  if(git_remote_ls(&heads, &nheads, r) < 0)
+    return -1;
+
+  git_remote_clear_refspecs(r);
 
+  if(git_remote_add_fetch(r, "+refs/tags/*:refs/tags/*") < 0)
+    return -1;
+
+  for(size_t i = 0; i < nheads; i++) {
+    const char *name = heads[i]->name;
+
+    if(!strncmp(name, "refs/tags/", strlen("refs/tags/")) ||
+       strstr(name, "^{}") != NULL || !ref_is_wanted(pc, name))
+      continue;
+
+    snprintf(refspec, sizeof(refspec), "+%s:%s", name, name);
+    if(git_remote_add_fetch(r, refspec) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Fetch from upstream using the given refspec. If 'refspec' is NULL
+ * only the refs we want (see ref_is_wanted()) are fetched.
+ *
+ * Must be called with p_repo_mutex held
+ */
+static int
+remote_fetch(project_t *p, const char *refspec, sync_aux_t *aux)
+{
   project_cfg(pc, p->p_id);
   if(pc == NULL)
     return DOOZER_ERROR_PERMANENT;
@@ -197,13 +688,10 @@ git_repo_sync(project_t *p)
     return DOOZER_ERROR_PERMANENT;
   }
 
-  const char *refspec = cfg_get_str(pc, CFG("gitrepo", "refspec"),
-                                    "+refs/*:refs/*");
-
-  plog(p, "git/repo", "Syncing repo from %s", upstream);
-
   git_remote *r;
-  if(git_remote_create_inmemory(&r, p->p_repo, refspec, upstream) < 0) {
+  if(git_remote_create_inmemory(&r, p->p_repo,
+                                refspec ?: "+refs/tags/*:refs/tags/*",
+                                upstream) < 0) {
     plog(p, "git/repo", "Unable to create in-memory remote");
     return DOOZER_ERROR_TRANSIENT;
   }
@@ -213,7 +701,7 @@ git_repo_sync(project_t *p)
   git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
 
   callbacks.update_tips = &update_cb;
-  callbacks.payload = p;
+  callbacks.payload = aux;
   if(isatty(1))
     callbacks.progress = &progress_cb;
   
@@ -228,13 +716,37 @@ git_repo_sync(project_t *p)
     goto done;
   }
 
+  if(refspec == NULL && remote_want_refs(pc, r)) {
+    plog(p, "git/repo", "Unable to set up refspecs for %s -- %s", upstream,
+         giterr());
+    goto disconnect;
+  }
+
+  // The ref advertisement is cheap, only negotiate and download
+  // if something has actually changed
+
+  if(!remote_has_changes(p, r)) {
+    trace(LOG_DEBUG, "%s: Repo is up to date with %s", p->p_id, upstream);
+    err = 0;
+    goto disconnect;
+  }
+
+  plog(p, "git/repo", "Syncing %s from %s", refspec ?: "wanted refs",
+       upstream);
+
   if (git_remote_download(r) < 0) {
     plog(p, "git/repo", "Unable to download from %s -- %s", upstream,
           giterr());
     goto disconnect;
   }
 
-  if(git_remote_update_tips(r) < 0) {
+  // Readers are only kept out while refs (and our caches) are updated
+
+  pthread_rwlock_wrlock(&p->p_refs_lock);
+  int rval = git_remote_update_tips(r);
+  pthread_rwlock_unlock(&p->p_refs_lock);
+
+  if(rval < 0) {
     plog(p, "git/repo", "Unable to update tips from %s -- %s", upstream,
           giterr());
   } else {
@@ -251,214 +763,887 @@ git_repo_sync(project_t *p)
 
 
 /**
+ * Drop unwanted refs from packed-refs by rewriting it in one go, since
+ * deleting them one at a time rewrites the whole file for each ref
+ *
+ * Locks and replaces the file the same way git and libgit2 do, via
+ * packed-refs.lock, so no one ever sees a partial file. libgit2 notices
+ * that the file was replaced and reloads it on next use. If someone
+ * else holds the lock we leave it be, prune_refs() deletes what
+ * remains one by one.
  *
+ * Must be called with p_refs_lock held exclusively
  */
 static int
-branchcmp(const ref_t *a, const ref_t *b)
+prune_packed_refs(project_t *p, cfg_t *pc)
 {
-  return dictcmp(b->name, a->name);
+  char path[PATH_MAX], lockpath[PATH_MAX], line[1024], name[1024];
+  int keep = 1, pruned = 0;
+
+  snprintf(path, sizeof(path), "%s/packed-refs",
+           git_repository_path(p->p_repo));
+  snprintf(lockpath, sizeof(lockpath), "%s.lock", path);
+
+  FILE *in = fopen(path, "r");
+  if(in == NULL)
+    return 0;
+
+  int fd = open(lockpath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if(fd == -1) {
+    fclose(in);
+    return errno == EEXIST ? 0 : -1;
+  }
+
+  FILE *out = fdopen(fd, "w");
+  if(out == NULL) {
+    close(fd);
+    unlink(lockpath);
+    fclose(in);
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), in) != NULL) {
+    // Peeled OID lines belong to the ref preceding them
+    if(line[0] != '^' && line[0] != '#') {
+      const char *s = strchr(line, ' ');
+      keep = 1;
+      if(s != NULL) {
+        s++;
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(s, "\r\n"), s);
+        keep = ref_is_wanted(pc, name);
+      }
+      pruned += !keep;
+    }
+    if(keep || line[0] == '#')
+      fputs(line, out);
+  }
+
+  int err = ferror(in) | ferror(out);
+  fclose(in);
+  err |= fclose(out);
+
+  if(err || !pruned) {
+    unlink(lockpath);
+    return err ? -1 : 0;
+  }
+
+  if(rename(lockpath, path)) {
+    unlink(lockpath);
+    return -1;
+  }
+  return pruned;
+}
+
+
+typedef struct prune_aux {
+  cfg_t *pc;
+  char **names;
+  int count;
+  int capacity;
+} prune_aux_t;
+
+
+/**
+ *
+ */
+static int
+prune_collect_cb(const char *name, void *payload)
+{
+  prune_aux_t *pa = payload;
+
+  if(ref_is_wanted(pa->pc, name))
+    return 0;
+
+  if(pa->count == pa->capacity) {
+    pa->capacity = pa->capacity * 2 + 16;
+    pa->names = realloc(pa->names, pa->capacity * sizeof(char *));
+  }
+  pa->names[pa->count++] = strdup(name);
+  return 0;
 }
 
 
 /**
+ * Delete all local refs we have no use for, such as refs/pull/* left
+ * over from mirroring everything
  *
+ * Must be called with p_repo_mutex held
+ */
+static void
+prune_refs(project_t *p, cfg_t *pc)
+{
+  prune_aux_t pa = {.pc = pc};
+  git_reference *ref;
+
+  pthread_rwlock_wrlock(&p->p_refs_lock);
+
+  int pruned = prune_packed_refs(p, pc);
+  if(pruned < 0) {
+    plog(p, "git/repo", "Unable to prune packed refs -- %s",
+         strerror(errno));
+    pruned = 0;
+  }
+
+  // Whatever remains are loose refs
+
+  git_reference_foreach_name(p->p_repo, prune_collect_cb, &pa);
+
+  for(int i = 0; i < pa.count; i++) {
+    if(!git_reference_lookup(&ref, p->p_repo, pa.names[i])) {
+      if(!git_reference_delete(ref))
+        pruned++;
+      git_reference_free(ref);
+    }
+    free(pa.names[i]);
+  }
+  free(pa.names);
+
+  if(pruned)
+    refs_changed(p);
+
+  pthread_rwlock_unlock(&p->p_refs_lock);
+
+  if(pruned)
+    plog(p, "git/repo", "Pruned %d unused refs", pruned);
+}
+
+
+/**
+ * Sync with upstream. With gitrepo.filterRefs set only the refs we
+ * make use of are fetched, and with gitrepo.pruneRefs also set all
+ * other refs are removed from the local repo.
  */
 int
-git_repo_list_branches(project_t *p, struct ref_list *bl)
+git_repo_sync(project_t *p)
+{
+  scoped_lock(&p->p_repo_mutex);
+
+  int retval;
+  if((retval = ensure_repo(p)))
+    return retval;
+
+  project_cfg(pc, p->p_id);
+  if(pc == NULL)
+    return DOOZER_ERROR_PERMANENT;
+
+  const int filter = cfg_get_int(pc, CFG("gitrepo", "filterRefs"), 0);
+
+  const char *refspec = filter ? NULL :
+    cfg_get_str(pc, CFG("gitrepo", "refspec"), "+refs/*:refs/*");
+
+  sync_aux_t aux = {
+    .p = p,
+    .jobs =
+    PROJECT_JOB_CHECK_FOR_BUILDS |
+    PROJECT_JOB_NOTIFY_REPO_UPDATE |
+    PROJECT_JOB_GENERATE_RELEASES,
+  };
+
+  retval = remote_fetch(p, refspec, &aux);
+
+  if(filter && cfg_get_int(pc, CFG("gitrepo", "pruneRefs"), 0))
+    prune_refs(p, pc);
+
+  if(aux.updated)
+    describe_refresh(p);
+  return retval;
+}
+
+
+/**
+ * Bring a single ref up to date with 'oid', as reported by a push
+ * notification
+ *
+ * If we already have the object and it's a fast-forward the ref is
+ * just moved, otherwise only that ref is fetched. The caller is
+ * responsible for checking for builds on the ref, other jobs are
+ * scheduled as for a full sync
+ */
+int
+git_repo_fetch_ref(project_t *p, const char *refname, const git_oid *oid)
+{
+  git_oid cur;
+  git_odb *odb;
+  char refspec[512];
+
+  scoped_lock(&p->p_repo_mutex);
+
+  int retval;
+  if((retval = ensure_repo(p)))
+    return retval;
+
+  project_cfg(pc, p->p_id);
+  if(pc == NULL)
+    return DOOZER_ERROR_PERMANENT;
+
+  if(cfg_get_int(pc, CFG("gitrepo", "filterRefs"), 0) &&
+     !ref_is_wanted(pc, refname))
+    return 0;
+
+  if(git_reference_name_to_id(&cur, p->p_repo, refname))
+    memset(&cur, 0, sizeof(cur));
+  else if(!git_oid_cmp(&cur, oid))
+    return 0;
+
+  sync_aux_t aux = {
+    .p = p,
+    .jobs =
+    PROJECT_JOB_NOTIFY_REPO_UPDATE |
+    PROJECT_JOB_GENERATE_RELEASES,
+  };
+
+  // Webhooks can arrive late or be redelivered, so only move the ref
+  // ourselves if it's a fast-forward. Otherwise the fetch gets us
+  // whatever upstream has now
+
+  int fastforward = 0;
+  if(!git_oid_iszero(&cur) && !git_repository_odb(&odb, p->p_repo)) {
+    fastforward = git_odb_exists(odb, oid) &&
+      git_graph_descendant_of(p->p_repo, oid, &cur) == 1;
+    git_odb_free(odb);
+  }
+
+  if(fastforward) {
+    git_reference *ref;
+
+    pthread_rwlock_wrlock(&p->p_refs_lock);
+    retval = git_reference_create(&ref, p->p_repo, refname, oid, 1);
+    if(!retval) {
+      update_cb(refname, &cur, oid, &aux);
+      git_reference_free(ref);
+    }
+    pthread_rwlock_unlock(&p->p_refs_lock);
+
+    if(retval) {
+      plog(p, "git/repo", "Unable to update %s -- %s", refname, giterr());
+      return DOOZER_ERROR_TRANSIENT;
+    }
+
+  } else {
+
+    snprintf(refspec, sizeof(refspec), "+%s:%s", refname, refname);
+    retval = remote_fetch(p, refspec, &aux);
+  }
+
+  if(aux.updated)
+    describe_refresh(p);
+  return retval;
+}
+
+
+/**
+ *
+ */
+static unsigned int
+ref_name_hash(const char *name)
+{
+  unsigned int h = 2166136261U;
+  for(; *name; name++)
+    h = (h ^ (uint8_t)*name) * 16777619U;
+  return h;
+}
+
+
+/**
+ *
+ */
+static int
+branchcmp(const void *A, const void *B)
+{
+  const ref_t *a = A, *b = B;
+  return dictcmp(b->name, a->name);
+}
+
+
+/**
+ *
+ */
+static ref_snapshot_t *
+ref_snapshot_create(git_repository *repo, int generation)
 {
   git_reference_iterator *iter;
   git_reference *ref;
-  ref_t *b;
-  LIST_INIT(bl);
-  scoped_lock(&p->p_repo_mutex);
+  int capacity = 0;
+
+  ref_snapshot_t *rs = calloc(1, sizeof(ref_snapshot_t));
+  rs->rs_refcount = 1;
+  rs->rs_generation = generation;
 
-  git_reference_iterator_glob_new(&iter, p->p_repo, "refs/heads/*");
+  git_reference_iterator_glob_new(&iter, repo, "refs/heads/*");
   while(!git_reference_next(&ref, iter)) {
-    b = calloc(1, sizeof(ref_t));
+    if(rs->rs_count == capacity) {
+      capacity = capacity * 2 + 16;
+      rs->rs_refs = realloc(rs->rs_refs, capacity * sizeof(ref_t));
+    }
+    ref_t *b = &rs->rs_refs[rs->rs_count++];
+    memset(b, 0, sizeof(ref_t));
     b->name = strdup(git_reference_name(ref) + strlen("refs/heads/"));
     git_oid_cpy(&b->oid, git_reference_target(ref));
     git_oid_fmt(b->oidtxt, &b->oid);
-    LIST_INSERT_SORTED(bl, b, link, branchcmp);
     git_reference_free(ref);
   }
   git_reference_iterator_free(iter);
+
+  qsort(rs->rs_refs, rs->rs_count, sizeof(ref_t), branchcmp);
+
+  unsigned int hashsize = 16;
+  while(hashsize < rs->rs_count * 2)
+    hashsize *= 2;
+
+  rs->rs_hashmask = hashsize - 1;
+  rs->rs_hash = malloc(hashsize * sizeof(int));
+  rs->rs_hashnext = malloc((rs->rs_count ?: 1) * sizeof(int));
+  memset(rs->rs_hash, 0xff, hashsize * sizeof(int));
+
+  for(int i = 0; i < rs->rs_count; i++) {
+    unsigned int h = ref_name_hash(rs->rs_refs[i].name) & rs->rs_hashmask;
+    rs->rs_hashnext[i] = rs->rs_hash[h];
+    rs->rs_hash[h] = i;
+  }
+  return rs;
+}
+
+
+/**
+ * Return the current branches of the project, or NULL if the repo is
+ * unavailable. The snapshot is shared and must not be modified, release
+ * it with ref_snapshot_release().
+ *
+ * A new snapshot is only taken on the first call after refs have been
+ * updated, all other calls just bump the refcount.
+ */
+ref_snapshot_t *
+git_repo_branches(project_t *p)
+{
+  ref_snapshot_t *rs;
+
+  pthread_mutex_lock(&p->p_branches_mutex);
+  rs = p->p_branches;
+  if(rs != NULL)
+    __sync_add_and_fetch(&rs->rs_refcount, 1);
+  pthread_mutex_unlock(&p->p_branches_mutex);
+
+  if(rs != NULL)
+    return rs;
+
+  // Refs can't change while we hold a reader, so the snapshot we take
+  // is consistent with the generation
+
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return NULL;
+
+  scoped_lock(&p->p_branches_mutex);
+
+  if(p->p_branches == NULL)
+    p->p_branches = ref_snapshot_create(gr.repo, p->p_refs_generation);
+
+  rs = p->p_branches;
+  __sync_add_and_fetch(&rs->rs_refcount, 1);
+  return rs;
+}
+
+
+/**
+ * Resolve 'refname' to the OID it points to
+ */
+int
+git_repo_resolve_ref(project_t *p, const char *refname, git_oid *oid)
+{
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return DOOZER_ERROR_TRANSIENT;
+
+  return git_reference_name_to_id(oid, gr.repo, refname) ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+const ref_t *
+ref_snapshot_find(const ref_snapshot_t *rs, const char *name)
+{
+  int i = rs->rs_hash[ref_name_hash(name) & rs->rs_hashmask];
+  for(; i != -1; i = rs->rs_hashnext[i])
+    if(!strcmp(rs->rs_refs[i].name, name))
+      return &rs->rs_refs[i];
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+ref_snapshot_release(ref_snapshot_t *rs)
+{
+  if(__sync_sub_and_fetch(&rs->rs_refcount, 1))
+    return;
+
+  for(int i = 0; i < rs->rs_count; i++)
+    free(rs->rs_refs[i].name);
+  free(rs->rs_refs);
+  free(rs->rs_hash);
+  free(rs->rs_hashnext);
+  free(rs);
+}
+
+
+/**
+ *
+ */
+void
+ref_snapshot_releasep(ref_snapshot_t **rsp)
+{
+  if(*rsp != NULL)
+    ref_snapshot_release(*rsp);
+}
+
+
+struct tag_list_aux {
+  git_repository *repo;
+  struct ref_list *rl;
+};
+
+
+/**
+ *
+ */
+static int
+tag_list_callback(const char *name, git_oid *oid, void *payload)
+{
+  struct tag_list_aux * aux = payload;
+  git_tag *tag;
+
+  ref_t *r = calloc(1, sizeof(ref_t));
+  r->name = strdup(name + strlen("refs/tags/"));
+
+  if(!git_tag_lookup(&tag, aux->repo, oid)) {
+    git_oid_cpy(&r->oid, git_tag_target_id(tag));
+  } else {
+    git_oid_cpy(&r->oid, oid);
+    tag = NULL;
+  }
+
+  git_oid_fmt(r->oidtxt, &r->oid);
+  LIST_INSERT_HEAD(aux->rl, r, link);
+  if(tag != NULL)
+    git_tag_free(tag);
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+git_repo_list_tags(project_t *p, struct ref_list *bl)
+{
+  struct tag_list_aux aux;
+
+  LIST_INIT(bl);
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return DOOZER_ERROR_TRANSIENT;
+
+  aux.repo = gr.repo;
+  aux.rl = bl;
+  git_tag_foreach(gr.repo, &tag_list_callback, &aux);
+  return 0;
+}
+
+
+/**
+ *
+ */
+void
+git_repo_free_refs(struct ref_list *bl)
+{
+  ref_t *b;
+  while((b = LIST_FIRST(bl)) != NULL) {
+    LIST_REMOVE(b, link);
+    free(b->name);
+    free(b);
+  }
+}
+
+/**
+ *
+ */
+static void
+version_snprint(char *out, size_t outlen, const char *tag, int distance,
+                const git_oid *oid)
+{
+  if(tag == NULL)
+    tag = "0.0";
+
+  if(distance) {
+    if(oid != NULL) {
+      char outhash[41];
+      git_oid_fmt(outhash, oid);
+      snprintf(out, outlen, "%s.%d-g%.8s", tag, distance, outhash);
+    } else {
+      snprintf(out, outlen, "%s.%d", tag, distance);
+    }
+  } else {
+    snprintf(out, outlen, "%s", tag);
+  }
+}
+
+
+
+/**
+ * Describe by walking the full history from 'start'
+ */
+static int
+describe_walk(project_t *p, git_repository *repo, const git_oid *start,
+              const char **tagp, int *distancep)
+{
+  git_oid oid;
+  git_revwalk *walk;
+  git_revwalk_new(&walk, repo);
+  git_revwalk_push(walk, start);
+  git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
+  int distance = 0;
+  const char *tag = NULL;
+  int retval = 1;
+  while(!git_revwalk_next(&oid, walk)) {
+    retval = 0;
+    if((tag = tag_index_find(tag_index_get(p, repo), &oid)) != NULL)
+      break;
+    distance++;
+  }
+  git_revwalk_free(walk);
+  *tagp = tag;
+  *distancep = distance;
+  return retval;
+}
+
+
+/**
+ * Must be called with p_cache_mutex held
+ */
+static describe_cache_t *
+describe_cache_get(project_t *p, git_repository *repo)
+{
+  char path[PATH_MAX];
+  tag_index_t *ti = tag_index_get(p, repo);
+
+  snprintf(path, sizeof(path), "%sdoozer-describe",
+           git_repository_path(repo));
+  p->p_describe_cache = describecache_open(p->p_describe_cache, path,
+                                           ti->ti_fingerprint);
+  return p->p_describe_cache;
+}
+
+
+/**
+ * Describe 'start' using memoized results
+ *
+ * An untagged commit with a single parent is the same as its parent
+ * with the distance increased by one, so we follow parents until we
+ * find something already known (or tagged) and fill in the cache on
+ * the way back. Merges and root commits are described by a full walk,
+ * once.
+ *
+ * Must be called with p_cache_mutex held
+ */
+static int
+describe_oid(project_t *p, git_repository *repo, const git_oid *start,
+             const char **tagp, int *distancep)
+{
+  describe_cache_t *dc = describe_cache_get(p, repo);
+  git_oid oid, *chain = NULL;
+  int depth = 0, chainsize = 0;
+  const char *tag;
+  int distance;
+
+  git_oid_cpy(&oid, start);
+
+  while(describecache_get(dc, &oid, &tag, &distance)) {
+
+    if((tag = tag_index_find(tag_index_get(p, repo), &oid)) != NULL) {
+      distance = 0;
+      break;
+    }
+
+    git_commit *c;
+    if(git_commit_lookup(&c, repo, &oid)) {
+      free(chain);
+      return describe_walk(p, repo, start, tagp, distancep);
+    }
+
+    if(git_commit_parentcount(c) != 1) {
+      git_commit_free(c);
+      if(describe_walk(p, repo, &oid, &tag, &distance)) {
+        free(chain);
+        return describe_walk(p, repo, start, tagp, distancep);
+      }
+      describecache_put(dc, &oid, tag, distance);
+      break;
+    }
+
+    if(depth == chainsize) {
+      chainsize = chainsize * 2 + 64;
+      chain = realloc(chain, chainsize * sizeof(git_oid));
+    }
+    git_oid_cpy(&chain[depth++], &oid);
+    git_oid_cpy(&oid, git_commit_parent_id(c, 0));
+    git_commit_free(c);
+  }
+
+  while(depth > 0) {
+    distance++;
+    describecache_put(dc, &chain[--depth], tag, distance);
+  }
+  free(chain);
+
+  *tagp = tag;
+  *distancep = distance;
   return 0;
 }
 
-struct tag_list_aux {
-  git_repository *repo;
-  struct ref_list *rl;
-};
+
+/**
+ * Describe all branch heads so commits that just arrived are known
+ * before anyone asks, and persist the results
+ */
+static void
+describe_refresh(project_t *p)
+{
+  git_reference_iterator *iter;
+  git_reference *ref;
+  const char *tag;
+  int distance;
+
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return;
+
+  scoped_lock(&p->p_cache_mutex);
+
+  if(git_reference_iterator_glob_new(&iter, gr.repo, "refs/heads/*"))
+    return;
+
+  while(!git_reference_next(&ref, iter)) {
+    const git_oid *oid = git_reference_target(ref);
+    if(oid != NULL)
+      describe_oid(p, gr.repo, oid, &tag, &distance);
+    git_reference_free(ref);
+  }
+  git_reference_iterator_free(iter);
+
+  if(p->p_describe_cache != NULL)
+    describecache_save(p->p_describe_cache);
+}
+
+
+/**
+ *
+ */
+int
+git_describe(char *out, size_t outlen, project_t *p, const char *revision,
+             int with_hash)
+{
+  git_oid start_oid;
+  const char *tag;
+  int distance;
+
+  if(git_oid_fromstr(&start_oid, revision))
+    return DOOZER_ERROR_PERMANENT;
+
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return DOOZER_ERROR_TRANSIENT;
+
+  scoped_lock(&p->p_cache_mutex);
+
+  int retval = describe_oid(p, gr.repo, &start_oid, &tag, &distance);
+
+  version_snprint(out, outlen, tag, distance,
+                  with_hash ? &start_oid : NULL);
+  return retval;
+}
+
 
 
 /**
  *
  */
-static int
-tag_list_callback(const char *name, git_oid *oid, void *payload)
+static change_t *
+make_change_from_ref(const git_oid *oid, tag_index_t *ti,
+                     struct change_queue *cq)
 {
-  struct tag_list_aux * aux = payload;
-  git_tag *tag;
-
-  ref_t *r = calloc(1, sizeof(ref_t));
-  r->name = strdup(name + strlen("refs/tags/"));
-
-  if(!git_tag_lookup(&tag, aux->repo, oid)) {
-    git_oid_cpy(&r->oid, git_tag_target_id(tag));
-  } else {
-    git_oid_cpy(&r->oid, oid);
-    tag = NULL;
-  }
-
-  git_oid_fmt(r->oidtxt, &r->oid);
-  LIST_INSERT_HEAD(aux->rl, r, link);
+  change_t *c = calloc(1, sizeof(change_t));
+  TAILQ_INSERT_TAIL(cq, c, link);
+  git_oid_cpy(&c->oid, oid);
+  const char *tag = tag_index_find(ti, oid);
   if(tag != NULL)
-    git_tag_free(tag);
-  return 0;
+    c->tag = strdup(tag);
+  return c;
 }
 
 
 /**
  *
  */
-int
-git_repo_list_tags(project_t *p, struct ref_list *bl)
+static void
+change_free(change_t *c)
 {
-  struct tag_list_aux aux;
-
-  scoped_lock(&p->p_repo_mutex);
-  LIST_INIT(bl);
-  aux.repo = p->p_repo;
-  aux.rl = bl;
-  git_tag_foreach(p->p_repo, &tag_list_callback, &aux);
-  return 0;
+  free(c->msg);
+  free(c->tag);
+  free(c);
 }
 
 
 /**
+ * Notes indexed by the OID they annotate, one index per notes ref.
+ * Replaced whenever the tip of the notes ref has moved.
  *
+ * The list is protected by p_cache_mutex, the indexes themselves are
+ * immutable and refcounted so they can be used without it
  */
-void
-git_repo_free_refs(struct ref_list *bl)
+#define NOTES_HASH_SIZE 256
+
+typedef struct note {
+  LIST_ENTRY(note) n_link;
+  git_oid n_oid;
+  char *n_msg;
+} note_t;
+
+LIST_HEAD(note_list, note);
+
+typedef struct notes_index {
+  LIST_ENTRY(notes_index) ni_link;
+  int ni_refcount;
+  char *ni_ref;
+  git_oid ni_tip;
+  int ni_count;
+  struct note_list ni_hash[NOTES_HASH_SIZE];
+} notes_index_t;
+
+
+/**
+ *
+ */
+static struct note_list *
+notes_index_bucket(notes_index_t *ni, const git_oid *oid)
 {
-  ref_t *b;
-  while((b = LIST_FIRST(bl)) != NULL) {
-    LIST_REMOVE(b, link);
-    free(b->name);
-    free(b);
-  }
+  return &ni->ni_hash[oid->id[0] & (NOTES_HASH_SIZE - 1)];
 }
 
+
 /**
  *
  */
 static void
-version_snprint(char *out, size_t outlen, const char *tag, int distance,
-                const git_oid *oid)
+notes_index_release(notes_index_t *ni)
 {
-  if(tag == NULL)
-    tag = "0.0";
+  note_t *n;
 
-  if(distance) {
-    if(oid != NULL) {
-      char outhash[41];
-      git_oid_fmt(outhash, oid);
-      snprintf(out, outlen, "%s.%d-g%.8s", tag, distance, outhash);
-    } else {
-      snprintf(out, outlen, "%s.%d", tag, distance);
+  if(ni == NULL || __sync_sub_and_fetch(&ni->ni_refcount, 1))
+    return;
+
+  for(int i = 0; i < NOTES_HASH_SIZE; i++) {
+    while((n = LIST_FIRST(&ni->ni_hash[i])) != NULL) {
+      LIST_REMOVE(n, n_link);
+      free(n->n_msg);
+      free(n);
     }
-  } else {
-    snprintf(out, outlen, "%s", tag);
   }
+  free(ni->ni_ref);
+  free(ni);
 }
 
 
+struct notes_index_aux {
+  git_repository *repo;
+  notes_index_t *ni;
+};
+
 
 /**
  *
  */
-static ref_t *
-ref_from_oid(const struct ref_list *rl, const git_oid *oid)
+static int
+notes_index_callback(const git_oid *blob_id, const git_oid *annotated_id,
+                     void *payload)
 {
-  ref_t *r;
-  LIST_FOREACH(r, rl, link)
-    if(!git_oid_cmp(&r->oid, oid))
-      return r;
-  return NULL;
+  struct notes_index_aux *aux = payload;
+  git_blob *blob;
+
+  if(git_blob_lookup(&blob, aux->repo, blob_id))
+    return 0;
+
+  size_t len = git_blob_rawsize(blob);
+  note_t *n = calloc(1, sizeof(note_t));
+  git_oid_cpy(&n->n_oid, annotated_id);
+  n->n_msg = malloc(len + 1);
+  memcpy(n->n_msg, git_blob_rawcontent(blob), len);
+  n->n_msg[len] = 0;
+  git_blob_free(blob);
+
+  LIST_INSERT_HEAD(notes_index_bucket(aux->ni, &n->n_oid), n, n_link);
+  aux->ni->ni_count++;
+  return 0;
 }
 
 
 /**
+ * Borrow the index for 'ref', returns NULL if there are no such notes.
+ * Give it back with notes_index_release()
  *
+ * Must be called with p_cache_mutex held
  */
-int
-git_describe(char *out, size_t outlen, project_t *p, const char *revision,
-             int with_hash)
+static notes_index_t *
+notes_index_acquire(project_t *p, git_repository *repo, const char *ref)
 {
-  git_oid start_oid, oid;
-
-  if(git_oid_fromstr(&start_oid, revision))
-    return DOOZER_ERROR_PERMANENT;
-
-  scoped_lock(&p->p_repo_mutex);
+  notes_index_t *ni;
+  git_oid tip;
 
-  struct ref_list rl;
-  LIST_INIT(&rl);
-  struct tag_list_aux tla;
-  tla.repo = p->p_repo;
-  tla.rl = &rl;
-  git_tag_foreach(p->p_repo, &tag_list_callback, &tla);
+  if(git_reference_name_to_id(&tip, repo, ref))
+    return NULL;
 
-  git_revwalk *walk;
-  git_revwalk_new(&walk, p->p_repo);
-  git_revwalk_push(walk, &start_oid);
-  git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
-  int distance = 0;
-  ref_t *r = NULL;
-  int retval = 1;
-  while(!git_revwalk_next(&oid, walk)) {
-    retval = 0;
-    if((r = ref_from_oid(&rl, &oid)) != NULL)
+  LIST_FOREACH(ni, &p->p_notes, ni_link)
+    if(!strcmp(ni->ni_ref, ref))
       break;
-    distance++;
-  }
 
-  version_snprint(out, outlen, r ? r->name : NULL, distance,
-                  with_hash ? &start_oid : NULL);
-  git_repo_free_refs(&rl);
-  git_revwalk_free(walk);
-
-  return retval;
-}
+  if(ni != NULL && git_oid_cmp(&ni->ni_tip, &tip)) {
+    LIST_REMOVE(ni, ni_link);
+    notes_index_release(ni);
+    ni = NULL;
+  }
 
+  if(ni == NULL) {
+    ni = calloc(1, sizeof(notes_index_t));
+    ni->ni_refcount = 1;
+    ni->ni_ref = strdup(ref);
+    git_oid_cpy(&ni->ni_tip, &tip);
 
+    struct notes_index_aux aux = {repo, ni};
+    git_note_foreach(repo, ref, &notes_index_callback, &aux);
+    LIST_INSERT_HEAD(&p->p_notes, ni, ni_link);
+  }
 
-/**
- *
- */
-static change_t *
-make_change_from_ref(const git_oid *oid, struct ref_list *rl,
-                     struct change_queue *cq)
-{
-  change_t *c = calloc(1, sizeof(change_t));
-  TAILQ_INSERT_TAIL(cq, c, link);
-  git_oid_cpy(&c->oid, oid);
-  ref_t *r = ref_from_oid(rl, oid);
-  if(r != NULL)
-    c->tag = strdup(r->name);
-  return c;
+  __sync_add_and_fetch(&ni->ni_refcount, 1);
+  return ni;
 }
 
 
 /**
  *
  */
-static void
-change_free(change_t *c)
+static const char *
+notes_index_find(notes_index_t *ni, const git_oid *oid)
 {
-  free(c->msg);
-  free(c->tag);
-  free(c);
+  note_t *n;
+  if(ni == NULL)
+    return NULL;
+  LIST_FOREACH(n, notes_index_bucket(ni, oid), n_link)
+    if(!git_oid_cmp(&n->n_oid, oid))
+      return n->n_msg;
+  return NULL;
 }
 
 
@@ -470,7 +1655,6 @@ git_changelog(struct change_queue *cq, project_t *p, const git_oid *start_oid,
               int offset, int count, int all, const char *target)
 {
   git_oid oid;
-  int retval;
   char tchangelog[128];
   change_t *c;
 
@@ -479,10 +1663,9 @@ git_changelog(struct change_queue *cq, project_t *p, const git_oid *start_oid,
   if(count == 0)
     return 0;
 
-  scoped_lock(&p->p_repo_mutex);
-
-  if((retval = ensure_repo(p)))
-    return retval;
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL)
+    return DOOZER_ERROR_TRANSIENT;
 
   // If we want to include target specific changelog, create the ref
   if(target) {
@@ -491,56 +1674,52 @@ git_changelog(struct change_queue *cq, project_t *p, const git_oid *start_oid,
     target = tchangelog;
   }
 
-  // First, figure out the tags we have
+  // Borrow the indexes, the walk itself runs without p_cache_mutex
 
-  struct ref_list rl;
-  LIST_INIT(&rl);
-  struct tag_list_aux tla;
-  tla.repo = p->p_repo;
-  tla.rl = &rl;
-  git_tag_foreach(p->p_repo, &tag_list_callback, &tla);
+  pthread_mutex_lock(&p->p_cache_mutex);
+  tag_index_t *ti = tag_index_acquire(p, gr.repo);
+  notes_index_t *tni = target ? notes_index_acquire(p, gr.repo, target) : NULL;
+  notes_index_t *gni = notes_index_acquire(p, gr.repo, "refs/notes/changelog");
+  pthread_mutex_unlock(&p->p_cache_mutex);
 
   git_revwalk *walk;
-  git_revwalk_new(&walk, p->p_repo);
+  git_revwalk_new(&walk, gr.repo);
   git_revwalk_push(walk, start_oid);
 
   git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
 
+  // Once every note has been seen there is nothing more to find
+  int unseen = (tni ? tni->ni_count : 0) + (gni ? gni->ni_count : 0);
+
   // Walk refs and search for matching changelog entries
 
   while(!git_revwalk_next(&oid, walk) && count) {
-    c = make_change_from_ref(&oid, &rl, cq);
-    git_note *note;
-
-    if(target != NULL) {
-      if(!git_note_read(&note, p->p_repo, target, &oid)) {
-        c->msg = strdup(git_note_message(note));
-        git_note_free(note);
-      }
+    c = make_change_from_ref(&oid, ti, cq);
+
+    const char *tm = notes_index_find(tni, &oid);
+    const char *gm = notes_index_find(gni, &oid);
+
+    if(tm != NULL && gm != NULL) {
+      int ml = strlen(gm);
+      int cl = strlen(tm);
+      char *out = malloc(cl + ml + 2);
+
+      memcpy(out, gm, ml);
+      out[ml] = '\n';
+      memcpy(out + ml + 1, tm, cl);
+      out[cl + ml + 1] = 0;
+      c->msg = out;
+    } else if(tm != NULL || gm != NULL) {
+      c->msg = strdup(tm ?: gm);
     }
 
-    if(!git_note_read(&note, p->p_repo, "refs/notes/changelog", &oid)) {
-      if(c->msg != NULL) {
-        const char *m = git_note_message(note);
-        int ml = strlen(m);
-        int cl = strlen(c->msg);
-        char *out = malloc(cl + ml + 2);
-
-        memcpy(out, m, ml);
-        out[ml] = '\n';
-        memcpy(out + ml + 1, c->msg, cl);
-        out[cl + ml + 1] = 0;
-        free(c->msg);
-        c->msg = out;
-
-      } else {
-        c->msg = strdup(git_note_message(note));
-      }
-      git_note_free(note);
-    }
+    unseen -= (tm != NULL) + (gm != NULL);
 
     if(all || c->msg)
       count--;
+
+    if(!all && unseen == 0)
+      break;
   }
 
   int distance = 0;
@@ -555,11 +1734,8 @@ git_changelog(struct change_queue *cq, project_t *p, const git_oid *start_oid,
       // Need to do some additional walking to find preceding tag and its distance
       while(!git_revwalk_next(&oid, walk)) {
         distance++;
-        ref_t *r = ref_from_oid(&rl, &oid);
-        if(r != NULL) {
-          tag = r->name;
+        if((tag = tag_index_find(ti, &oid)) != NULL)
           break;
-        }
       }
       if(tag == NULL)
         tag = "0.0";
@@ -590,8 +1766,10 @@ git_changelog(struct change_queue *cq, project_t *p, const git_oid *start_oid,
       }
     }
   }
-  git_repo_free_refs(&rl);
   git_revwalk_free(walk);
+  notes_index_release(tni);
+  notes_index_release(gni);
+  tag_index_release(ti);
   return 0;
 }
 
@@ -623,100 +1801,282 @@ const char *giterr(void)
 }
 
 
-int
-git_get_file(project_t *p, const git_oid *oid,
-             const char *path, void **datap, size_t *sizep,
-             char *errbuf, size_t errlen)
+/**
+ * Cache of in-tree files
+ *
+ * Both commits and blobs are immutable, so we remember which blob a
+ * path in a commit resolves to, and the parsed contents of JSON blobs
+ * by blob OID. Neither is ever invalidated, entries are just evicted
+ * in LRU order once there are more than gitBlobCacheSize of them.
+ */
+
+#define BLOB_CACHE_HASHSIZE 256
+
+LIST_HEAD(blob_cache_entry_list, blob_cache_entry);
+TAILQ_HEAD(blob_cache_entry_queue, blob_cache_entry);
+
+typedef struct blob_cache_entry {
+  LIST_ENTRY(blob_cache_entry) bce_link;
+  TAILQ_ENTRY(blob_cache_entry) bce_lru_link;
+  git_oid bce_oid;     // Commit OID for paths, blob OID for documents
+  char *bce_path;      // Path in commit, NULL for documents
+  git_oid bce_blob;    // Paths only
+  htsmsg_t *bce_doc;   // Documents only
+} blob_cache_entry_t;
+
+typedef struct blob_cache {
+  struct blob_cache_entry_list bc_hash[BLOB_CACHE_HASHSIZE];
+  struct blob_cache_entry_queue bc_lru;
+  int bc_count;
+} blob_cache_t;
+
+
+/**
+ *
+ */
+static struct blob_cache_entry_list *
+blob_cache_bucket(blob_cache_t *bc, const git_oid *oid, const char *path)
 {
-  git_tree *tree = NULL;
-  git_commit *commit = NULL;
-  git_object *dir = NULL;
-  git_object *blob = NULL;
-  const git_tree_entry *e;
+  unsigned int h = oid->id[0] | oid->id[1] << 8;
+  if(path != NULL)
+    h ^= ref_name_hash(path);
+  return &bc->bc_hash[h & (BLOB_CACHE_HASHSIZE - 1)];
+}
 
-  char *filename = mystrdupa(path);
-  char *next;
 
-  int r = -1;
+/**
+ * Must be called with p_blob_cache_mutex held
+ */
+static blob_cache_entry_t *
+blob_cache_find(project_t *p, const git_oid *oid, const char *path)
+{
+  blob_cache_t *bc = p->p_blob_cache;
+  blob_cache_entry_t *bce;
 
-  scoped_lock(&p->p_repo_mutex);
+  if(bc == NULL)
+    return NULL;
 
-  if(git_commit_lookup(&commit, p->p_repo, oid)) {
-    snprintf(errbuf, errlen,
-             "Unable to lookup commit id when looking for manifest");
-    return -1;
+  LIST_FOREACH(bce, blob_cache_bucket(bc, oid, path), bce_link) {
+    if(git_oid_cmp(&bce->bce_oid, oid))
+      continue;
+    if(path == NULL ? bce->bce_path != NULL :
+       bce->bce_path == NULL || strcmp(bce->bce_path, path))
+      continue;
+
+    TAILQ_REMOVE(&bc->bc_lru, bce, bce_lru_link);
+    TAILQ_INSERT_TAIL(&bc->bc_lru, bce, bce_lru_link);
+    return bce;
   }
+  return NULL;
+}
 
-  if(git_commit_tree(&tree, commit)) {
-    snprintf(errbuf, errlen,
-             "Unable to open git tree when looking for manifest");
-    goto cleanup;
+
+/**
+ * Must be called with p_blob_cache_mutex held
+ */
+static blob_cache_entry_t *
+blob_cache_insert(project_t *p, const git_oid *oid, const char *path)
+{
+  blob_cache_t *bc = p->p_blob_cache;
+  blob_cache_entry_t *bce;
+
+  if(bc == NULL) {
+    bc = p->p_blob_cache = calloc(1, sizeof(blob_cache_t));
+    TAILQ_INIT(&bc->bc_lru);
   }
 
-  while((next = strchr(filename, '/')) != NULL) {
-    while(*next == '/')
-      *next++ = 0;
+  cfg_root(root);
+  int max = cfg_get_int(root, CFG("gitBlobCacheSize"), 1024);
+
+  while(bc->bc_count >= max && (bce = TAILQ_FIRST(&bc->bc_lru)) != NULL) {
+    TAILQ_REMOVE(&bc->bc_lru, bce, bce_lru_link);
+    LIST_REMOVE(bce, bce_link);
+    free(bce->bce_path);
+    if(bce->bce_doc != NULL)
+      htsmsg_destroy(bce->bce_doc);
+    free(bce);
+    bc->bc_count--;
+  }
 
-    // Directory (or tree) component
+  bce = calloc(1, sizeof(blob_cache_entry_t));
+  git_oid_cpy(&bce->bce_oid, oid);
+  bce->bce_path = path ? strdup(path) : NULL;
+  LIST_INSERT_HEAD(blob_cache_bucket(bc, oid, path), bce, bce_link);
+  TAILQ_INSERT_TAIL(&bc->bc_lru, bce, bce_lru_link);
+  bc->bc_count++;
+  return bce;
+}
 
-    printf("filename=%s\n", filename);
 
-    if((e = git_tree_entry_byname(tree, filename)) == NULL)  {
-      snprintf(errbuf, errlen,
-               "'%s' directory not found", filename);
-      goto cleanup;
-    }
+/**
+ * Resolve 'path' in commit 'oid' to the OID of the blob it refers to
+ */
+static int
+resolve_blob(project_t *p, git_repository *repo, const git_oid *oid,
+             const char *path, git_oid *blob, char *errbuf, size_t errlen)
+{
+  git_commit *commit = NULL;
+  git_tree *tree = NULL;
+  git_tree_entry *e = NULL;
+  blob_cache_entry_t *bce;
+  int r = -1;
 
-    if(git_tree_entry_to_object(&dir, p->p_repo, e)) {
-      snprintf(errbuf, errlen,
-               "Unable to lookup '%s' tree object", filename);
-      goto cleanup;
-    }
+  pthread_mutex_lock(&p->p_blob_cache_mutex);
+  if((bce = blob_cache_find(p, oid, path)) != NULL)
+    git_oid_cpy(blob, &bce->bce_blob);
+  pthread_mutex_unlock(&p->p_blob_cache_mutex);
 
-    if(git_object_type(dir) != GIT_OBJ_TREE) {
-      snprintf(errbuf, errlen,
-               "'%s' is not a tree object", filename);
-      goto cleanup;
-    }
+  if(bce != NULL)
+    return 0;
 
-    git_tree_free(tree);
-    tree = (git_tree *)dir;
-    dir = NULL;
-    filename = next;
+  if(git_commit_lookup(&commit, repo, oid)) {
+    snprintf(errbuf, errlen, "Unable to lookup commit");
+    return -1;
   }
 
-  if((e = git_tree_entry_byname((git_tree *)tree, filename)) == NULL)  {
-    snprintf(errbuf, errlen, "'%s' not found", filename);
+  if(git_commit_tree(&tree, commit)) {
+    snprintf(errbuf, errlen, "Unable to open git tree");
     goto cleanup;
   }
 
-  if(git_tree_entry_to_object(&blob, p->p_repo, e)) {
-    snprintf(errbuf, errlen, "Unable to lookup '%s' object", filename);
+  if(git_tree_entry_bypath(&e, tree, path)) {
+    snprintf(errbuf, errlen, "'%s' not found", path);
     goto cleanup;
   }
 
-  if(git_object_type(blob) != GIT_OBJ_BLOB) {
-    snprintf(errbuf, errlen, "'%s' is not a file", filename);
+  if(git_tree_entry_type(e) != GIT_OBJ_BLOB) {
+    snprintf(errbuf, errlen, "'%s' is not a file", path);
     goto cleanup;
   }
 
+  git_oid_cpy(blob, git_tree_entry_id(e));
+
+  pthread_mutex_lock(&p->p_blob_cache_mutex);
+  if(blob_cache_find(p, oid, path) == NULL)
+    git_oid_cpy(&blob_cache_insert(p, oid, path)->bce_blob, blob);
+  pthread_mutex_unlock(&p->p_blob_cache_mutex);
+  r = 0;
+
+ cleanup:
+  if(e != NULL)
+    git_tree_entry_free(e);
+  if(tree != NULL)
+    git_tree_free(tree);
+  git_commit_free(commit);
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+git_get_file(project_t *p, const git_oid *oid,
+             const char *path, void **datap, size_t *sizep,
+             char *errbuf, size_t errlen)
+{
+  git_oid blobid;
+  git_blob *blob;
+
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL) {
+    snprintf(errbuf, errlen, "Repo not available");
+    return -1;
+  }
+
+  if(resolve_blob(p, gr.repo, oid, path, &blobid, errbuf, errlen))
+    return -1;
+
+  if(git_blob_lookup(&blob, gr.repo, &blobid)) {
+    snprintf(errbuf, errlen, "Unable to lookup '%s' object", path);
+    return -1;
+  }
 
-  size_t size = git_blob_rawsize((git_blob *)blob);
+  size_t size = git_blob_rawsize(blob);
   char *data = talloc_malloc(size + 1);
-  memcpy(data, git_blob_rawcontent((git_blob *)blob), size);
+  memcpy(data, git_blob_rawcontent(blob), size);
   data[size] = 0;
+  git_blob_free(blob);
 
   if(sizep != NULL)
     *sizep = size;
 
   *datap = data;
-  r = 0;
+  return 0;
+}
 
- cleanup:
-  git_object_free(blob);
-  if(tree != NULL)
-    git_tree_free(tree);
-  if(commit != NULL)
-    git_commit_free(commit);
-  return r;
+
+/**
+ * Get the OID of the blob at 'path' in commit 'oid', without touching
+ * the ODB if we've looked it up before
+ */
+int
+git_get_blob_oid(project_t *p, const git_oid *oid, const char *path,
+                 git_oid *blob, char *errbuf, size_t errlen)
+{
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL) {
+    snprintf(errbuf, errlen, "Repo not available");
+    return -1;
+  }
+  return resolve_blob(p, gr.repo, oid, path, blob, errbuf, errlen);
+}
+
+
+/**
+ * Return the JSON document at 'path' in commit 'oid', parsed. The
+ * returned message is a copy owned by the caller.
+ */
+htsmsg_t *
+git_get_json(project_t *p, const git_oid *oid, const char *path,
+             char *errbuf, size_t errlen)
+{
+  git_oid blobid;
+  git_blob *blob;
+  blob_cache_entry_t *bce;
+  htsmsg_t *doc = NULL;
+
+  scoped_git_reader(gr, p);
+  if(gr.repo == NULL) {
+    snprintf(errbuf, errlen, "Repo not available");
+    return NULL;
+  }
+
+  if(resolve_blob(p, gr.repo, oid, path, &blobid, errbuf, errlen))
+    return NULL;
+
+  pthread_mutex_lock(&p->p_blob_cache_mutex);
+  if((bce = blob_cache_find(p, &blobid, NULL)) != NULL)
+    doc = htsmsg_copy(bce->bce_doc);
+  pthread_mutex_unlock(&p->p_blob_cache_mutex);
+
+  if(doc != NULL)
+    return doc;
+
+  if(git_blob_lookup(&blob, gr.repo, &blobid)) {
+    snprintf(errbuf, errlen, "Unable to lookup '%s' object", path);
+    return NULL;
+  }
+
+  size_t size = git_blob_rawsize(blob);
+  char *data = malloc(size + 1);
+  memcpy(data, git_blob_rawcontent(blob), size);
+  data[size] = 0;
+  git_blob_free(blob);
+
+  char decodeerr[256];
+  doc = htsmsg_json_deserialize(data, decodeerr, sizeof(decodeerr));
+  free(data);
+
+  if(doc == NULL) {
+    snprintf(errbuf, errlen, "Unable to decode JSON in '%s' -- %s",
+             path, decodeerr);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&p->p_blob_cache_mutex);
+  if(blob_cache_find(p, &blobid, NULL) == NULL)
+    blob_cache_insert(p, &blobid, NULL)->bce_doc = htsmsg_copy(doc);
+  pthread_mutex_unlock(&p->p_blob_cache_mutex);
+  return doc;
 }
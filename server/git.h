@@ -20,9 +20,54 @@ typedef struct ref {
   char oidtxt[41];
 } ref_t;
 
+/**
+ * Immutable snapshot of a project's branches, see git_repo_branches()
+ */
+typedef struct ref_snapshot {
+  int rs_refcount;
+  int rs_generation;     // p_refs_generation it was taken at
+  int rs_count;
+  ref_t *rs_refs;        // In descending dictionary order (4.3 before 4.1)
+  unsigned int rs_hashmask;
+  int *rs_hash;          // Bucket heads, index into rs_refs or -1
+  int *rs_hashnext;      // Chain, per ref
+} ref_snapshot_t;
+
+/**
+ * A read-only handle to a project's repo, see git_reader_acquire()
+ */
+typedef struct git_reader {
+  project_t *p;
+  git_repository *repo;
+} git_reader_t;
+
+git_reader_t git_reader_acquire(project_t *p);
+
+void git_reader_release(git_reader_t *gr);
+
+#define scoped_git_reader(x, p) \
+  git_reader_t x __attribute__((cleanup(git_reader_release))) = \
+    git_reader_acquire(p)
+
 int git_repo_sync(project_t *p);
 
-int git_repo_list_branches(project_t *p, struct ref_list *rl);
+int git_repo_fetch_ref(project_t *p, const char *refname, const git_oid *oid);
+
+ref_snapshot_t *git_repo_branches(project_t *p);
+
+const ref_t *ref_snapshot_find(const ref_snapshot_t *rs, const char *name);
+
+void ref_snapshot_release(ref_snapshot_t *rs);
+
+void ref_snapshot_releasep(ref_snapshot_t **rsp);
+
+int git_repo_resolve_ref(project_t *p, const char *refname, git_oid *oid);
+
+uint64_t git_repo_tags_fingerprint(project_t *p);
+
+#define scoped_ref_snapshot(x, p) \
+  ref_snapshot_t *x __attribute__((cleanup(ref_snapshot_releasep))) = \
+    git_repo_branches(p)
 
 int git_repo_list_tags(project_t *p, struct ref_list *rl);
 
@@ -40,4 +85,10 @@ int git_get_file(project_t *p, const git_oid *oid,
                  const char *path, void **datap, size_t *sizep,
                  char *errbuf, size_t errlen);
 
+int git_get_blob_oid(project_t *p, const git_oid *oid, const char *path,
+                     git_oid *blob, char *errbuf, size_t errlen);
+
+htsmsg_t *git_get_json(project_t *p, const git_oid *oid, const char *path,
+                       char *errbuf, size_t errlen);
+
 const char *giterr(void);
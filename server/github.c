@@ -78,7 +78,9 @@ http_github(http_connection_t *hc, const char *remain, void *opaque)
     return 400;
   }
 
-  const char *ref = htsmsg_get_str(msg, "ref");
+  const char *fullref = htsmsg_get_str(msg, "ref");
+  const char *after = htsmsg_get_str(msg, "after");
+  const char *ref = fullref;
   if(ref != NULL && !strncmp(ref, "refs/heads/", strlen("refs/heads/")))
     ref += strlen("refs/heads/");
 
@@ -134,7 +136,15 @@ http_github(http_connection_t *hc, const char *remain, void *opaque)
       plog(p, ctx, "%s", buf);
       plog(p, ctx, "%s", msg);
     }
-    project_schedule_job(p, PROJECT_JOB_UPDATE_REPO);
+
+    // We know exactly what changed, so just go get that
+
+    git_oid oid;
+    if(fullref != NULL && after != NULL &&
+       !git_oid_fromstr(&oid, after) && !git_oid_iszero(&oid))
+      project_push_received(p, fullref, &oid);
+    else
+      project_schedule_job(p, PROJECT_JOB_UPDATE_REPO);
   }
   htsmsg_destroy(msg);
   return 200;
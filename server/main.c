@@ -24,6 +24,7 @@
 #include "libsvc/libsvc.h"
 
 #include "artifact_serve.h"
+#include "patchstash.h"
 #include "doozer.h"
 #include "project.h"
 #include "buildmaster.h"
@@ -148,6 +149,8 @@ main(int argc, char **argv)
     exit(1);
   }
 
+  patchstash_init();
+
   artifact_serve_init();
 
   ctrlsock_init(ctrlsockpath);
@@ -0,0 +1,316 @@
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <openssl/sha.h>
+#include <zlib.h>
+
+#include "libsvc/http.h"
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+
+#include "manifestcache.h"
+
+/**
+ * Release manifests as last written by the releasemaker, ready to be
+ * served by the REST API without touching the manifest storage.
+ *
+ * Each manifest is kept both as is and gzip compressed together with
+ * a strong ETag derived from its content. Entries are immutable once
+ * published, a new version replaces the old entry and whoever is
+ * currently sending the old one holds a reference to it.
+ *
+ * Manifests read from a local manifestDir remember which version of
+ * the file they came from and are read again once it has changed.
+ */
+
+LIST_HEAD(manifest_list, manifest);
+
+typedef struct manifest {
+  LIST_ENTRY(manifest) m_link;
+  int m_refcount;
+  char *m_project;
+  char *m_name;
+
+  char *m_raw;
+  size_t m_rawlen;
+  char m_etag[44];     // "<sha1>"
+
+  void *m_gz;          // NULL if compression failed
+  size_t m_gzlen;
+  char m_gzetag[48];   // "<sha1>-gz"
+
+  // Source file, all zero if published by the releasemaker
+  time_t m_mtime;
+  off_t m_size;
+  ino_t m_ino;
+} manifest_t;
+
+static pthread_mutex_t manifests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct manifest_list manifests;
+
+
+/**
+ *
+ */
+static void
+manifest_release(manifest_t *m)
+{
+  if(__sync_add_and_fetch(&m->m_refcount, -1))
+    return;
+  free(m->m_project);
+  free(m->m_name);
+  free(m->m_raw);
+  free(m->m_gz);
+  free(m);
+}
+
+
+/**
+ * Must be called with manifests_mutex held
+ */
+static manifest_t *
+manifest_find(const char *project, const char *name)
+{
+  manifest_t *m;
+  LIST_FOREACH(m, &manifests, m_link) {
+    if(!strcmp(m->m_project, project) && !strcmp(m->m_name, name))
+      break;
+  }
+  return m;
+}
+
+
+/**
+ * Compress 'len' bytes at 'data' into a malloc'ed gzip stream
+ */
+static void *
+gzip_buf(const void *data, size_t len, size_t *outlen)
+{
+  z_stream z = {0};
+
+  if(deflateInit2(&z, 9, Z_DEFLATED, 16 + MAX_WBITS, 9,
+                  Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t cap = deflateBound(&z, len);
+  void *out = malloc(cap);
+
+  z.next_in = (void *)data;
+  z.avail_in = len;
+  z.next_out = out;
+  z.avail_out = cap;
+
+  if(deflate(&z, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&z);
+    free(out);
+    return NULL;
+  }
+
+  *outlen = z.total_out;
+  deflateEnd(&z);
+  return out;
+}
+
+
+/**
+ * Make 'json' the current version of manifest 'name' in 'project'
+ *
+ * 'st' is the file it was read from, if any
+ */
+static void
+manifest_publish(const char *project, const char *name, const char *json,
+                 const struct stat *st)
+{
+  uint8_t md[SHA_DIGEST_LENGTH];
+  char hex[SHA_DIGEST_LENGTH * 2 + 1];
+  size_t len = strlen(json);
+  manifest_t *m;
+
+  SHA1((const void *)json, len, md);
+  for(int i = 0; i < SHA_DIGEST_LENGTH; i++)
+    snprintf(hex + i * 2, 3, "%02x", md[i]);
+
+  pthread_mutex_lock(&manifests_mutex);
+  m = manifest_find(project, name);
+  const int unchanged = m != NULL && !strncmp(m->m_etag + 1, hex, 40);
+  if(unchanged && st != NULL) {
+    m->m_mtime = st->st_mtime;
+    m->m_size = st->st_size;
+    m->m_ino = st->st_ino;
+  }
+  pthread_mutex_unlock(&manifests_mutex);
+
+  if(unchanged)
+    return;
+
+  // Compress outside of the lock, it's the expensive part
+
+  m = calloc(1, sizeof(manifest_t));
+  m->m_refcount = 1;
+  m->m_project = strdup(project);
+  m->m_name = strdup(name);
+  m->m_raw = strdup(json);
+  m->m_rawlen = len;
+  snprintf(m->m_etag, sizeof(m->m_etag), "\"%s\"", hex);
+  snprintf(m->m_gzetag, sizeof(m->m_gzetag), "\"%s-gz\"", hex);
+  m->m_gz = gzip_buf(json, len, &m->m_gzlen);
+  if(st != NULL) {
+    m->m_mtime = st->st_mtime;
+    m->m_size = st->st_size;
+    m->m_ino = st->st_ino;
+  }
+
+  pthread_mutex_lock(&manifests_mutex);
+  manifest_t *old = manifest_find(project, name);
+  if(old != NULL) {
+    LIST_REMOVE(old, m_link);
+    manifest_release(old);
+  }
+  LIST_INSERT_HEAD(&manifests, m, m_link);
+  pthread_mutex_unlock(&manifests_mutex);
+}
+
+
+/**
+ *
+ */
+void
+manifestcache_publish(const char *project, const char *name,
+                      const char *json)
+{
+  manifest_publish(project, name, json, NULL);
+}
+
+
+/**
+ * Return 1 if 'etag' is in the If-None-Match header 'inm'
+ */
+static int
+etag_match(const char *inm, const char *etag)
+{
+  const size_t len = strlen(etag);
+
+  while(*inm) {
+    while(*inm == ' ' || *inm == ',')
+      inm++;
+    if(!strncmp(inm, "W/", 2))
+      inm += 2;
+    if(*inm == '*' || !strncmp(inm, etag, len))
+      return 1;
+    while(*inm && *inm != ',')
+      inm++;
+  }
+  return 0;
+}
+
+
+/**
+ * Return 1 if the Accept-Encoding header 'ae' allows gzip
+ */
+static int
+accepts_gzip(const char *ae)
+{
+  while(*ae) {
+    while(*ae == ' ' || *ae == ',')
+      ae++;
+
+    const char *end = strchr(ae, ',') ?: ae + strlen(ae);
+    if(!strncasecmp(ae, "gzip", 4) &&
+       (ae + 4 == end || ae[4] == ' ' || ae[4] == ';')) {
+      const char *q = strstr(ae, "q=");
+      return q == NULL || q > end || strtod(q + 2, NULL) > 0;
+    }
+    ae = end;
+  }
+  return 0;
+}
+
+
+/**
+ * Send manifest 'name' of 'project', returns 404 if it's not known
+ */
+int
+manifestcache_serve(http_connection_t *hc, const char *project,
+                    const char *name)
+{
+  manifest_t *m;
+
+  pthread_mutex_lock(&manifests_mutex);
+  m = manifest_find(project, name);
+  if(m != NULL)
+    __sync_add_and_fetch(&m->m_refcount, 1);
+  pthread_mutex_unlock(&manifests_mutex);
+
+  if(m == NULL)
+    return 404;
+
+  const char *ae = http_arg_get(&hc->hc_args, "Accept-Encoding");
+  const int gz = m->m_gz != NULL && ae != NULL && accepts_gzip(ae);
+  const char *etag = gz ? m->m_gzetag : m->m_etag;
+
+  http_arg_set(&hc->hc_response_headers, "ETag", etag);
+  http_arg_set(&hc->hc_response_headers, "Vary", "Accept-Encoding");
+
+  const char *inm = http_arg_get(&hc->hc_args, "If-None-Match");
+  if(inm != NULL && etag_match(inm, etag)) {
+    http_send_header(hc, HTTP_STATUS_NOT_MODIFIED, NULL, 0, NULL,
+                     NULL, 0, NULL, NULL, NULL);
+    manifest_release(m);
+    return 0;
+  }
+
+  if(gz) {
+    http_arg_set(&hc->hc_response_headers, "Content-Encoding", "gzip");
+    htsbuf_append(&hc->hc_reply, m->m_gz, m->m_gzlen);
+  } else {
+    htsbuf_append(&hc->hc_reply, m->m_raw, m->m_rawlen);
+  }
+  manifest_release(m);
+  http_output_content(hc, "application/json");
+  return 0;
+}
+
+
+/**
+ * Send manifest 'name' of 'project' as stored in the file 'path',
+ * reading it again if it has changed since we last did
+ */
+int
+manifestcache_serve_file(http_connection_t *hc, const char *project,
+                         const char *name, const char *path)
+{
+  struct stat st;
+
+  if(stat(path, &st)) {
+    trace(LOG_ERR, "Unable to stat file %s -- %s", path, strerror(errno));
+    return 404;
+  }
+
+  pthread_mutex_lock(&manifests_mutex);
+  const manifest_t *m = manifest_find(project, name);
+  const int current = m != NULL &&
+    m->m_mtime == st.st_mtime &&
+    m->m_size == st.st_size &&
+    m->m_ino == st.st_ino;
+  pthread_mutex_unlock(&manifests_mutex);
+
+  if(!current) {
+    int err;
+    char *json = readfile(path, &err, NULL);
+    if(json == NULL) {
+      trace(LOG_ERR, "Unable to read file %s -- %s", path, strerror(err));
+      return 404;
+    }
+    manifest_publish(project, name, json, &st);
+    free(json);
+  }
+  return manifestcache_serve(hc, project, name);
+}
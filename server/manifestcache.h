@@ -0,0 +1,12 @@
+#pragma once
+
+#include "libsvc/http.h"
+
+void manifestcache_publish(const char *project, const char *name,
+                           const char *json);
+
+int manifestcache_serve(http_connection_t *hc, const char *project,
+                        const char *name);
+
+int manifestcache_serve_file(http_connection_t *hc, const char *project,
+                             const char *name, const char *path);
@@ -0,0 +1,718 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libsvc/misc.h"
+#include "libsvc/trace.h"
+#include "libsvc/cfg.h"
+#include "libsvc/db.h"
+#include "libsvc/threading.h"
+
+#include "patchstash.h"
+#include "sql_statements.h"
+
+/**
+ * The patchstash keeps generated patches on disk named as
+ * <oldsha1>-<newsha1>[.ext]. We track size, last access time and hit
+ * count for each patch so we can keep the stash within a byte budget.
+ *
+ * The bookkeeping is kept in memory and periodically persisted to an
+ * index file in the stash directory itself.
+ *
+ * Pairs that did not produce a worthwhile patch are remembered as
+ * negative entries (stored with size -1 in the index) so we never try
+ * to diff them again. They stay until one of the artifacts is deleted.
+ */
+
+#define PATCHSTASH_INDEX    "index"
+#define PATCHSTASH_HASHSIZE 256
+
+LIST_HEAD(patchstash_entry_list, patchstash_entry);
+
+typedef struct patchstash_entry {
+  LIST_ENTRY(patchstash_entry) pe_link;
+  char pe_name[96];
+  off_t pe_size;
+  time_t pe_atime;
+  int pe_hits;
+  int pe_mark;
+  int pe_negative;
+} patchstash_entry_t;
+
+static struct patchstash_entry_list patchstash_hash[PATCHSTASH_HASHSIZE];
+static pthread_mutex_t patchstash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int patchstash_dirty;
+
+
+/**
+ * Names start with a hex encoded SHA-1 so the first byte is evenly
+ * distributed
+ */
+static int
+patchstash_hashfn(const char *name)
+{
+  char hex[3] = {name[0], name[0] ? name[1] : 0, 0};
+  return strtoul(hex, NULL, 16) & (PATCHSTASH_HASHSIZE - 1);
+}
+
+
+/**
+ * Must be called with patchstash_mutex held
+ */
+static patchstash_entry_t *
+patchstash_find(const char *name, int create)
+{
+  patchstash_entry_t *pe;
+  struct patchstash_entry_list *head =
+    &patchstash_hash[patchstash_hashfn(name)];
+
+  LIST_FOREACH(pe, head, pe_link)
+    if(!strcmp(pe->pe_name, name))
+      return pe;
+
+  if(!create)
+    return NULL;
+
+  pe = calloc(1, sizeof(patchstash_entry_t));
+  snprintf(pe->pe_name, sizeof(pe->pe_name), "%s", name);
+  LIST_INSERT_HEAD(head, pe, pe_link);
+  return pe;
+}
+
+
+/**
+ * Only files that look like patches are managed by us
+ */
+static int
+patchstash_valid_name(const char *name)
+{
+  int i;
+  for(i = 0; i < 40; i++)
+    if(!isxdigit((unsigned char)name[i]))
+      return 0;
+  if(name[40] != '-')
+    return 0;
+  for(i = 41; i < 81; i++)
+    if(!isxdigit((unsigned char)name[i]))
+      return 0;
+  if(name[81] != 0 && name[81] != '.')
+    return 0;
+  return strlen(name) < sizeof(((patchstash_entry_t *)0)->pe_name) &&
+    strstr(name, ".tmp") == NULL;
+}
+
+
+/**
+ *
+ */
+void
+patchstash_add(const char *name, off_t size)
+{
+  scoped_lock(&patchstash_mutex);
+  patchstash_entry_t *pe = patchstash_find(name, 1);
+  pe->pe_size = size;
+  pe->pe_atime = time(NULL);
+  pe->pe_negative = 0;
+  patchstash_dirty = 1;
+}
+
+
+/**
+ *
+ */
+void
+patchstash_hit(const char *name)
+{
+  scoped_lock(&patchstash_mutex);
+  patchstash_entry_t *pe = patchstash_find(name, 0);
+  if(pe == NULL)
+    return;
+  pe->pe_atime = time(NULL);
+  pe->pe_hits++;
+  patchstash_dirty = 1;
+}
+
+
+/**
+ *
+ */
+void
+patchstash_add_negative(const char *name)
+{
+  scoped_lock(&patchstash_mutex);
+  patchstash_entry_t *pe = patchstash_find(name, 1);
+  pe->pe_size = 0;
+  pe->pe_atime = time(NULL);
+  pe->pe_negative = 1;
+  patchstash_dirty = 1;
+}
+
+
+/**
+ *
+ */
+int
+patchstash_is_negative(const char *name)
+{
+  scoped_lock(&patchstash_mutex);
+  patchstash_entry_t *pe = patchstash_find(name, 0);
+  return pe != NULL && pe->pe_negative;
+}
+
+
+/**
+ *
+ */
+static void
+patchstash_load_index(const char *path)
+{
+  char line[256];
+  char name[128];
+  long long size;
+  long long atime;
+  int hits;
+
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return;
+
+  scoped_lock(&patchstash_mutex);
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    if(sscanf(line, "%127s %lld %lld %d", name, &size, &atime, &hits) != 4)
+      continue;
+    if(!patchstash_valid_name(name))
+      continue;
+    patchstash_entry_t *pe = patchstash_find(name, 1);
+    pe->pe_negative = size < 0;
+    pe->pe_size = pe->pe_negative ? 0 : size;
+    pe->pe_atime = atime;
+    pe->pe_hits = hits;
+  }
+  fclose(fp);
+}
+
+
+/**
+ *
+ */
+static void
+patchstash_save_index(const char *path)
+{
+  char tmp[PATH_MAX];
+  patchstash_entry_t *pe;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  FILE *fp = fopen(tmp, "w");
+  if(fp == NULL) {
+    trace(LOG_ERR, "patchstash: Unable to write %s -- %s",
+          tmp, strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&patchstash_mutex);
+  for(int i = 0; i < PATCHSTASH_HASHSIZE; i++) {
+    LIST_FOREACH(pe, &patchstash_hash[i], pe_link) {
+      fprintf(fp, "%s %lld %lld %d\n", pe->pe_name,
+              pe->pe_negative ? -1LL : (long long)pe->pe_size,
+              (long long)pe->pe_atime, pe->pe_hits);
+    }
+  }
+  patchstash_dirty = 0;
+  pthread_mutex_unlock(&patchstash_mutex);
+
+  if(fclose(fp) || rename(tmp, path)) {
+    trace(LOG_ERR, "patchstash: Unable to write %s -- %s",
+          path, strerror(errno));
+    unlink(tmp);
+  }
+}
+
+
+/**
+ * Pick up patches that exist on disk but are not in the index and
+ * forget about entries whose file has gone missing
+ */
+static void
+patchstash_scan(const char *dir)
+{
+  char path[PATH_MAX];
+  struct dirent *d;
+  struct stat st;
+  patchstash_entry_t *pe, *next;
+
+  DIR *dp = opendir(dir);
+  if(dp == NULL)
+    return;
+
+  scoped_lock(&patchstash_mutex);
+
+  for(int i = 0; i < PATCHSTASH_HASHSIZE; i++)
+    LIST_FOREACH(pe, &patchstash_hash[i], pe_link)
+      pe->pe_mark = !pe->pe_negative;
+
+  while((d = readdir(dp)) != NULL) {
+    if(!patchstash_valid_name(d->d_name))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+    if(stat(path, &st) || !S_ISREG(st.st_mode))
+      continue;
+
+    pe = patchstash_find(d->d_name, 1);
+    if(pe->pe_negative)
+      continue;
+    if(pe->pe_atime == 0) {
+      pe->pe_atime = st.st_mtime;
+      patchstash_dirty = 1;
+    }
+    if(pe->pe_size != st.st_size) {
+      pe->pe_size = st.st_size;
+      patchstash_dirty = 1;
+    }
+    pe->pe_mark = 0;
+  }
+  closedir(dp);
+
+  for(int i = 0; i < PATCHSTASH_HASHSIZE; i++) {
+    for(pe = LIST_FIRST(&patchstash_hash[i]); pe != NULL; pe = next) {
+      next = LIST_NEXT(pe, pe_link);
+      if(pe->pe_mark) {
+        LIST_REMOVE(pe, pe_link);
+        free(pe);
+        patchstash_dirty = 1;
+      }
+    }
+  }
+}
+
+
+#define PATCHSTASH_QUERY_BATCH 256
+
+/**
+ * An artifact referenced from the stash
+ */
+typedef struct artifact_ref {
+  char ar_sha1[41];
+  int ar_exists;
+} artifact_ref_t;
+
+
+/**
+ *
+ */
+static int
+artifact_ref_cmp(const void *A, const void *B)
+{
+  const artifact_ref_t *a = A;
+  const artifact_ref_t *b = B;
+  return strcmp(a->ar_sha1, b->ar_sha1);
+}
+
+
+/**
+ * Sort and deduplicate 'v' and find out which of the artifacts still
+ * exist, asking for PATCHSTASH_QUERY_BATCH of them per query.
+ *
+ * Returns the number of unique entries left in 'v' or -1 on error
+ */
+static int
+artifacts_exist(db_conn_t *c, artifact_ref_t *v, int num)
+{
+  int n = 0;
+
+  qsort(v, num, sizeof(artifact_ref_t), artifact_ref_cmp);
+  for(int i = 0; i < num; i++) {
+    if(n > 0 && !strcmp(v[n - 1].ar_sha1, v[i].ar_sha1))
+      continue;
+    v[n] = v[i];
+    v[n].ar_exists = 0;
+    n++;
+  }
+
+  for(int base = 0; base < n; base += PATCHSTASH_QUERY_BATCH) {
+    const int cnt = n - base < PATCHSTASH_QUERY_BATCH ?
+      n - base : PATCHSTASH_QUERY_BATCH;
+    char query[64 + PATCHSTASH_QUERY_BATCH * 2];
+    db_args_t args[cnt];
+
+    int l = snprintf(query, sizeof(query),
+                     "SELECT DISTINCT sha1 FROM artifact WHERE sha1 IN (");
+    for(int i = 0; i < cnt; i++) {
+      l += snprintf(query + l, sizeof(query) - l, i ? ",?" : "?");
+      args[i].type = 's';
+      args[i].str = v[base + i].ar_sha1;
+    }
+    snprintf(query + l, sizeof(query) - l, ")");
+
+    scoped_db_stmt(s, query);
+    if(s == NULL || db_stmt_execa(s, cnt, args))
+      return -1;
+
+    while(1) {
+      artifact_ref_t key;
+      int r = db_stream_row(0, s, DB_RESULT_STRING(key.ar_sha1));
+      if(r < 0)
+        return -1;
+      if(r)
+        break;
+      artifact_ref_t *ar = bsearch(&key, v + base, cnt,
+                                   sizeof(artifact_ref_t), artifact_ref_cmp);
+      if(ar != NULL)
+        ar->ar_exists = 1;
+    }
+  }
+  return n;
+}
+
+
+/**
+ * Return 0 if the artifact 'sha1' is known to be gone
+ */
+static int
+artifact_ref_exists(const artifact_ref_t *v, int n, const char *sha1)
+{
+  artifact_ref_t key;
+  snprintf(key.ar_sha1, sizeof(key.ar_sha1), "%.40s", sha1);
+  const artifact_ref_t *ar = bsearch(&key, v, n, sizeof(artifact_ref_t),
+                                     artifact_ref_cmp);
+  return ar == NULL || ar->ar_exists;
+}
+
+
+/**
+ * Snapshot of an entry used while sweeping without holding the lock
+ */
+typedef struct patchstash_candidate {
+  char name[96];
+  off_t size;
+  time_t atime;
+  int hits;
+  int negative;
+} patchstash_candidate_t;
+
+
+/**
+ * Least recently used first, fewer hits breaks ties
+ */
+static int
+candidate_cmp(const void *A, const void *B)
+{
+  const patchstash_candidate_t *a = A;
+  const patchstash_candidate_t *b = B;
+
+  if(a->atime != b->atime)
+    return a->atime < b->atime ? -1 : 1;
+  return a->hits - b->hits;
+}
+
+
+/**
+ *
+ */
+static void
+patchstash_remove(const char *dir, const char *name, const char *reason)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+  if(unlink(path) && errno != ENOENT) {
+    trace(LOG_ERR, "patchstash: Unable to remove %s -- %s",
+          path, strerror(errno));
+    return;
+  }
+
+  trace(LOG_DEBUG, "patchstash: Removed %s -- %s", name, reason);
+
+  pthread_mutex_lock(&patchstash_mutex);
+  patchstash_entry_t *pe = patchstash_find(name, 0);
+  if(pe != NULL) {
+    LIST_REMOVE(pe, pe_link);
+    free(pe);
+    patchstash_dirty = 1;
+  }
+  pthread_mutex_unlock(&patchstash_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+patchstash_sweep(const char *dir, int64_t budget)
+{
+  patchstash_entry_t *pe;
+  patchstash_candidate_t *v;
+  int num = 0, cap = 0;
+  int64_t total = 0;
+
+  pthread_mutex_lock(&patchstash_mutex);
+  for(int i = 0; i < PATCHSTASH_HASHSIZE; i++)
+    LIST_FOREACH(pe, &patchstash_hash[i], pe_link)
+      cap++;
+
+  v = malloc(sizeof(patchstash_candidate_t) * (cap + 1));
+
+  for(int i = 0; i < PATCHSTASH_HASHSIZE; i++) {
+    LIST_FOREACH(pe, &patchstash_hash[i], pe_link) {
+      patchstash_candidate_t *pc = &v[num++];
+      strcpy(pc->name, pe->pe_name);
+      pc->size  = pe->pe_size;
+      pc->atime = pe->pe_atime;
+      pc->hits  = pe->pe_hits;
+      pc->negative = pe->pe_negative;
+    }
+  }
+  pthread_mutex_unlock(&patchstash_mutex);
+
+  // Remove patches from or to artifacts that no longer exist
+
+  db_conn_t *c = db_get_conn();
+  artifact_ref_t *refs = malloc(sizeof(artifact_ref_t) * (num * 2 + 1));
+  for(int i = 0; i < num; i++) {
+    snprintf(refs[i * 2].ar_sha1, 41, "%.40s", v[i].name);
+    snprintf(refs[i * 2 + 1].ar_sha1, 41, "%.40s", v[i].name + 41);
+  }
+  const int numrefs = c != NULL ? artifacts_exist(c, refs, num * 2) : -1;
+
+  for(int i = 0; i < num; i++) {
+    patchstash_candidate_t *pc = &v[i];
+
+    if(numrefs >= 0 &&
+       (!artifact_ref_exists(refs, numrefs, pc->name) ||
+        !artifact_ref_exists(refs, numrefs, pc->name + 41))) {
+      patchstash_remove(dir, pc->name, "Artifact deleted");
+      pc->size = -1;
+      continue;
+    }
+    total += pc->size;
+  }
+  free(refs);
+
+  // Evict until we're within budget
+
+  if(budget > 0 && total > budget) {
+    qsort(v, num, sizeof(patchstash_candidate_t), candidate_cmp);
+
+    int64_t before = total;
+    int evicted = 0;
+    for(int i = 0; i < num && total > budget; i++) {
+      if(v[i].size < 0 || v[i].negative)
+        continue;
+      patchstash_remove(dir, v[i].name, "Evicted");
+      total -= v[i].size;
+      evicted++;
+    }
+    trace(LOG_INFO,
+          "patchstash: Evicted %d patches, %"PRId64" -> %"PRId64" bytes "
+          "(budget %"PRId64")", evicted, before, total, budget);
+  }
+  free(v);
+}
+
+
+/**
+ * Suffix arrays of popular old artifacts are cached as <oldsha1>.sa
+ * in a separate directory. Unlike patches there is no index, the
+ * file mtime is bumped on every use and serves as LRU clock.
+ */
+int
+patchstash_sacache_path(const char *oldsha1, char *path, size_t pathlen,
+                        int *store)
+{
+  patchstash_entry_t *pe;
+  int uses = 0;
+  cfg_root(root);
+
+  const char *dir = cfg_get_str(root, CFG("sacache"),
+                                "/var/tmp/doozer/sacache");
+  const int minuses = cfg_get_int(root, CFG("sacacheMinUses"), 2);
+
+  if(cfg_get_int(root, CFG("sacacheMaxSize"), 4096) <= 0)
+    return -1;
+
+  if(makedirs(dir)) {
+    trace(LOG_ERR, "Unable to create suffix array cache directory %s -- %s",
+          dir, strerror(errno));
+    return -1;
+  }
+
+  snprintf(path, pathlen, "%s/%s.sa", dir, oldsha1);
+
+  if(!utimes(path, NULL)) {
+    *store = 0;
+    return 0;
+  }
+
+  // All patches from the same old artifact live in the same bucket
+
+  pthread_mutex_lock(&patchstash_mutex);
+  LIST_FOREACH(pe, &patchstash_hash[patchstash_hashfn(oldsha1)], pe_link)
+    if(!strncmp(pe->pe_name, oldsha1, 40))
+      uses++;
+  pthread_mutex_unlock(&patchstash_mutex);
+
+  // Count the diff we're about to do as well
+  *store = uses + 1 >= minuses;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+sacache_sweep(const char *dir, int64_t budget)
+{
+  char path[PATH_MAX];
+  struct dirent *d;
+  struct stat st;
+  patchstash_candidate_t *v = NULL;
+  int num = 0, cap = 0;
+  int64_t total = 0;
+
+  DIR *dp = opendir(dir);
+  if(dp == NULL)
+    return;
+
+  const time_t now = time(NULL);
+
+  while((d = readdir(dp)) != NULL) {
+    if(strlen(d->d_name) == 50 && !strncmp(d->d_name + 40, ".sa.", 4)) {
+      // Temp file left behind by a crashed writer, see sa_store()
+      snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+      if(!stat(path, &st) && st.st_mtime < now - 3600)
+        unlink(path);
+      continue;
+    }
+    if(strlen(d->d_name) != 43 || strcmp(d->d_name + 40, ".sa"))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+    if(stat(path, &st) || !S_ISREG(st.st_mode))
+      continue;
+
+    if(num == cap) {
+      cap = cap ? cap * 2 : 64;
+      v = realloc(v, sizeof(patchstash_candidate_t) * cap);
+    }
+    patchstash_candidate_t *pc = &v[num++];
+    memset(pc, 0, sizeof(patchstash_candidate_t));
+    strcpy(pc->name, d->d_name);
+    pc->size  = st.st_size;
+    pc->atime = st.st_mtime;
+  }
+  closedir(dp);
+
+  db_conn_t *c = db_get_conn();
+  artifact_ref_t *refs = malloc(sizeof(artifact_ref_t) * (num + 1));
+  for(int i = 0; i < num; i++)
+    snprintf(refs[i].ar_sha1, 41, "%.40s", v[i].name);
+  const int numrefs = c != NULL ? artifacts_exist(c, refs, num) : -1;
+
+  for(int i = 0; i < num; i++) {
+    patchstash_candidate_t *pc = &v[i];
+    if(numrefs >= 0) {
+      if(!artifact_ref_exists(refs, numrefs, pc->name)) {
+        snprintf(path, sizeof(path), "%s/%s", dir, pc->name);
+        unlink(path);
+        trace(LOG_DEBUG, "sacache: Removed %s -- Artifact deleted",
+              pc->name);
+        pc->size = -1;
+        continue;
+      }
+    }
+    total += pc->size;
+  }
+  free(refs);
+
+  if(budget > 0 && total > budget) {
+    qsort(v, num, sizeof(patchstash_candidate_t), candidate_cmp);
+
+    for(int i = 0; i < num && total > budget; i++) {
+      if(v[i].size < 0)
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", dir, v[i].name);
+      unlink(path);
+      trace(LOG_DEBUG, "sacache: Removed %s -- Evicted", v[i].name);
+      total -= v[i].size;
+    }
+  }
+  free(v);
+}
+
+
+/**
+ *
+ */
+static void *
+patchstash_thread(void *aux)
+{
+  char index[PATH_MAX];
+
+  while(1) {
+    {
+      cfg_root(root);
+
+      const char *dir = cfg_get_str(root, CFG("patchstash"),
+                                    "/var/tmp/doozer/patchstash");
+      // Budget is configured in MB
+      const int64_t budget =
+        (int64_t)cfg_get_int(root, CFG("patchstashMaxSize"), 10240) *
+        1024 * 1024;
+
+      snprintf(index, sizeof(index), "%s/%s", dir, PATCHSTASH_INDEX);
+
+      patchstash_scan(dir);
+      patchstash_sweep(dir, budget);
+
+      if(patchstash_dirty)
+        patchstash_save_index(index);
+
+      sacache_sweep(cfg_get_str(root, CFG("sacache"),
+                                "/var/tmp/doozer/sacache"),
+                    (int64_t)cfg_get_int(root, CFG("sacacheMaxSize"), 4096) *
+                    1024 * 1024);
+    }
+    sleep(60);
+  }
+  return NULL;
+}
+
+
+/**
+ * The index is loaded before we return so negative entries are known
+ * before any patch requests are served
+ */
+void
+patchstash_init(void)
+{
+  char index[PATH_MAX];
+  pthread_t tid;
+
+  {
+    cfg_root(root);
+    const char *dir = cfg_get_str(root, CFG("patchstash"),
+                                  "/var/tmp/doozer/patchstash");
+    snprintf(index, sizeof(index), "%s/%s", dir, PATCHSTASH_INDEX);
+  }
+  patchstash_load_index(index);
+
+  int err = pthread_create(&tid, NULL, patchstash_thread, NULL);
+  if(err)
+    trace(LOG_ERR, "patchstash: Unable to start sweeper thread -- %s",
+          strerror(err));
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <sys/types.h>
+
+void patchstash_init(void);
+
+void patchstash_add(const char *name, off_t size);
+
+void patchstash_hit(const char *name);
+
+void patchstash_add_negative(const char *name);
+
+int patchstash_is_negative(const char *name);
+
+int patchstash_sacache_path(const char *oldsha1, char *path, size_t pathlen,
+                            int *store);
@@ -1,5 +1,9 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np()
+#endif
 #include <sys/param.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -149,7 +153,22 @@ project_init(const char *id, int forceinit)
   if(p == NULL) {
 
     p = calloc(1, sizeof(project_t));
+    TAILQ_INIT(&p->p_pushes);
     pthread_mutex_init(&p->p_repo_mutex, NULL);
+    pthread_mutex_init(&p->p_reader_mutex, NULL);
+    pthread_cond_init(&p->p_reader_cond, NULL);
+    pthread_mutex_init(&p->p_cache_mutex, NULL);
+    pthread_mutex_init(&p->p_branches_mutex, NULL);
+    pthread_mutex_init(&p->p_blob_cache_mutex, NULL);
+
+    // Readers come and go all the time, don't let them starve syncs
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&p->p_refs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
     p->p_id = strdup(id);
     LIST_INSERT_HEAD(&projects, p, p_link);
     trace(LOG_INFO, "%s: Project initialized", p->p_id);
@@ -168,6 +187,59 @@ project_init(const char *id, int forceinit)
 }
 
 
+/**
+ * Time until the next periodic refresh. Failing remotes are backed off
+ * exponentially and everything is jittered by +-10% so projects with
+ * the same interval don't all hit upstream at once.
+ *
+ * Must be called with projects_mutex held
+ */
+static int
+project_refresh_delay(const project_t *p)
+{
+  int delay = p->p_refresh_interval;
+
+  if(p->p_sync_failures) {
+    int64_t backoff = (int64_t)delay << MIN(p->p_sync_failures, 16);
+    delay = MIN(backoff, MAX(p->p_refresh_max_backoff, delay));
+  }
+
+  int jitter = delay / 10;
+  if(jitter)
+    delay += random() % (2 * jitter + 1) - jitter;
+  return MAX(delay, 1);
+}
+
+
+/**
+ * Bring pushed refs up to date and check them for builds right away
+ */
+static void
+project_fetch_pushed_refs(project_t *p)
+{
+  project_push_t *pp;
+
+  pthread_mutex_lock(&projects_mutex);
+  while((pp = TAILQ_FIRST(&p->p_pushes)) != NULL) {
+    TAILQ_REMOVE(&p->p_pushes, pp, pp_link);
+    pthread_mutex_unlock(&projects_mutex);
+
+    if(git_repo_fetch_ref(p, pp->pp_ref, &pp->pp_oid)) {
+      plog(p, "git/repo", "Unable to fetch pushed ref %s, doing full sync",
+           pp->pp_ref);
+      project_schedule_job(p, PROJECT_JOB_UPDATE_REPO);
+    } else if(!strncmp(pp->pp_ref, "refs/heads/", strlen("refs/heads/"))) {
+      buildmaster_check_for_builds(p, pp->pp_ref + strlen("refs/heads/"));
+    }
+
+    free(pp->pp_ref);
+    free(pp);
+    pthread_mutex_lock(&projects_mutex);
+  }
+  pthread_mutex_unlock(&projects_mutex);
+}
+
+
 /**
  *
  */
@@ -187,14 +259,27 @@ project_worker(void *aux)
     p->p_pending_jobs = 0;
     pthread_mutex_unlock(&projects_mutex);
 
-    if(pendings & PROJECT_JOB_UPDATE_REPO)
-      git_repo_sync(p);
+    if(pendings & PROJECT_JOB_FETCH_PUSHED_REFS)
+      project_fetch_pushed_refs(p);
+
+    if(pendings & PROJECT_JOB_UPDATE_REPO) {
+      int err = git_repo_sync(p);
+
+      pthread_mutex_lock(&projects_mutex);
+      p->p_sync_failures = err ? p->p_sync_failures + 1 : 0;
+      if(p->p_next_refresh)
+        p->p_next_refresh = time(NULL) + project_refresh_delay(p);
+      pthread_mutex_unlock(&projects_mutex);
+    }
 
     if(pendings & PROJECT_JOB_NOTIFY_REPO_UPDATE)
       project_notify_repo_update(p);
 
     if(pendings & PROJECT_JOB_CHECK_FOR_BUILDS)
-      buildmaster_check_for_builds(p);
+      buildmaster_check_for_builds(p, NULL);
+
+    if(pendings & PROJECT_JOB_FLUSH_RELEASES)
+      releasemaker_flush_cache(p);
 
     if(pendings & PROJECT_JOB_GENERATE_RELEASES)
       releasemaker_update_project(p);
@@ -239,8 +324,9 @@ project_thread(void *aux)
       if(p->p_next_refresh) {
 
         if(now >= p->p_next_refresh) {
+          // Rescheduled by the worker once the sync is done
           p->p_pending_jobs |= PROJECT_JOB_UPDATE_REPO;
-          p->p_next_refresh = now + p->p_refresh_interval;
+          p->p_next_refresh = now + project_refresh_delay(p);
         } else if(p->p_next_refresh) {
           next_check = MIN(next_check, p->p_next_refresh);
         }
@@ -279,7 +365,35 @@ void
 project_schedule_job(project_t *p, int mask)
 {
   pthread_mutex_lock(&projects_mutex);
-  p->p_pending_jobs = mask;
+  p->p_pending_jobs |= mask;
+  pthread_cond_broadcast(&projects_cond);
+  pthread_mutex_unlock(&projects_mutex);
+}
+
+
+/**
+ * Queue a ref update from a push notification. Only the latest update
+ * of each ref is kept
+ */
+void
+project_push_received(project_t *p, const char *ref, const git_oid *oid)
+{
+  project_push_t *pp;
+
+  pthread_mutex_lock(&projects_mutex);
+
+  TAILQ_FOREACH(pp, &p->p_pushes, pp_link)
+    if(!strcmp(pp->pp_ref, ref))
+      break;
+
+  if(pp == NULL) {
+    pp = calloc(1, sizeof(project_push_t));
+    pp->pp_ref = strdup(ref);
+    TAILQ_INSERT_TAIL(&p->p_pushes, pp, pp_link);
+  }
+  git_oid_cpy(&pp->pp_oid, oid);
+
+  p->p_pending_jobs |= PROJECT_JOB_FETCH_PUSHED_REFS;
   pthread_cond_broadcast(&projects_cond);
   pthread_mutex_unlock(&projects_mutex);
 }
@@ -400,13 +514,20 @@ project_load_conf(char *fname, const char *path)
 
   project_t *p = project_init(fname, pc->pc_mtime != mtime);
 
+  // Config changes may alter the generated manifests in ways that are
+  // not fingerprinted, so regenerate all of them
+  project_schedule_job(p, PROJECT_JOB_FLUSH_RELEASES);
+
   pc->pc_mtime = mtime;
 
   p->p_refresh_interval =
     cfg_get_int(pc->pc_msg, CFG("gitrepo", "refreshInterval"), 0);
+  p->p_refresh_max_backoff =
+    cfg_get_int(pc->pc_msg, CFG("gitrepo", "maxBackoff"), 3600);
 
+  // Spread the first refresh of all projects over the interval
   if(p->p_refresh_interval)
-    p->p_next_refresh = time(NULL) + p->p_refresh_interval;
+    p->p_next_refresh = time(NULL) + 1 + random() % p->p_refresh_interval;
   else
     p->p_next_refresh = 0;
 
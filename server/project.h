@@ -8,10 +8,22 @@
 #define PROJECT_JOB_CHECK_FOR_BUILDS   0x2
 #define PROJECT_JOB_GENERATE_RELEASES  0x4
 #define PROJECT_JOB_NOTIFY_REPO_UPDATE 0x8
+#define PROJECT_JOB_FETCH_PUSHED_REFS  0x10
+#define PROJECT_JOB_FLUSH_RELEASES     0x20
+
+#define PROJECT_GIT_READERS_MAX 16
 
 LIST_HEAD(project_list, project);
 LIST_HEAD(pconf_list, pconf);
 
+TAILQ_HEAD(project_push_queue, project_push);
+
+struct tag_index;
+struct ref_snapshot;
+struct describe_cache;
+struct blob_cache;
+struct release_cache;
+
 extern pthread_mutex_t projects_mutex;
 extern pthread_cond_t projects_cond;
 extern pthread_mutex_t project_cfg_mutex;
@@ -32,6 +44,16 @@ typedef struct pconf {
 } pconf_t;
 
 
+/**
+ * A ref update received from a push notification
+ */
+typedef struct project_push {
+  TAILQ_ENTRY(project_push) pp_link;
+  char *pp_ref;
+  git_oid pp_oid;
+} project_push_t;
+
+
 /**
  *
  */
@@ -49,16 +71,49 @@ typedef struct project {
   int p_active_jobs;
   int p_failed_jobs;
 
+  struct project_push_queue p_pushes; // Protected by projects_mutex
+
   // --------------------------------------------------
   // --------------------------------------------------
 
+  // Syncs are serialized by p_repo_mutex and use p_repo. Everything
+  // else borrows a handle from the reader pool, see git_reader_acquire()
+
   pthread_mutex_t p_repo_mutex;
   git_repository *p_repo;
 
+  pthread_rwlock_t p_refs_lock;  // Held exclusively while updating refs
+  int p_refs_generation;         // Bumped whenever refs are updated
+
+  pthread_mutex_t p_branches_mutex;
+  struct ref_snapshot *p_branches;  // NULL until asked for after update
+
+  pthread_mutex_t p_reader_mutex;
+  pthread_cond_t p_reader_cond;
+  git_repository *p_readers[PROJECT_GIT_READERS_MAX];
+  int p_num_free_readers;
+  int p_num_readers;
+
+  // Caches derived from the repo, see git.c
+
+  pthread_mutex_t p_cache_mutex;
+  struct tag_index *p_tag_index;  // Tags by peeled OID
+  struct describe_cache *p_describe_cache;
+  LIST_HEAD(, notes_index) p_notes;  // Changelog notes
+
+  pthread_mutex_t p_blob_cache_mutex;
+  struct blob_cache *p_blob_cache;  // In-tree files, see git_get_json()
+
+  // Only used by the releasemaker, which runs on the project worker
+
+  struct release_cache *p_release_cache;
+
   // --------------------------------------------------
   // -- GIT Repo refresh time -------------------------
 
   int p_refresh_interval;
+  int p_refresh_max_backoff;
+  int p_sync_failures;   // Consecutive, protected by projects_mutex
   time_t p_next_refresh;
 
 } project_t;
@@ -73,6 +128,8 @@ void projects_init(void);
 
 void project_schedule_job(project_t *p, int mask);
 
+void project_push_received(project_t *p, const char *ref, const git_oid *oid);
+
 #define project_cfg(x, id) cfg_t *x __attribute__((cleanup(cfg_releasep))) = project_get_cfg(id);
 
 cfg_t *project_get_cfg(const char *id);
@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <regex.h>
@@ -11,6 +12,8 @@
 #include <errno.h>
 #include <fnmatch.h>
 
+#include <openssl/md5.h>
+
 #include "libsvc/misc.h"
 #include "libsvc/htsmsg_json.h"
 #include "libsvc/trace.h"
@@ -23,6 +26,9 @@
 #include "git.h"
 #include "sql_statements.h"
 #include "s3.h"
+#include "bsdiff.h"
+#include "artifact_serve.h"
+#include "manifestcache.h"
 
 typedef struct releasemaker {
   project_t *p;
@@ -41,22 +47,127 @@ typedef struct releasemaker {
 
 
 /**
- * Write a manifest file
+ * A serialized manifest to write
+ */
+typedef struct manifest_file {
+  const char *mf_name;
+  char *mf_json;
+  int mf_err;
+} manifest_file_t;
+
+
+/**
+ * Hex MD5 of a manifest, same as the ETag S3 returns for a plain PUT
+ */
+static void
+manifest_md5(char out[33], const char *data, size_t len)
+{
+  uint8_t md[MD5_DIGEST_LENGTH];
+  MD5((const void *)data, len, md);
+  for(int i = 0; i < MD5_DIGEST_LENGTH; i++)
+    snprintf(out + i * 2, 3, "%02x", md[i]);
+}
+
+
+/**
+ *
+ */
+typedef struct manifest_path {
+  const char *mp_path;
+  int mp_index;
+} manifest_path_t;
+
+
+/**
+ *
  */
 static int
-write_manifest(releasemaker_t *rm, htsmsg_t *m, const char *name)
+manifest_path_cmp(const void *A, const void *B)
+{
+  const manifest_path_t *a = A;
+  const manifest_path_t *b = B;
+  return strcmp(a->mp_path, b->mp_path);
+}
+
+
+/**
+ * Set skip[i] for each of 'puts' that S3 already has, that is if the
+ * last upload to the same path had the same MD5 and S3 confirmed it
+ * by returning that as ETag
+ */
+static void
+s3_manifests_unchanged(const char *bucket, const aws_s3_put_t *puts,
+                       char (*md5)[33], int *skip, int count)
+{
+  const size_t qlen = 128 + count * 2;
+  char *query = talloc_malloc(qlen);
+  db_args_t args[count + 1];
+  manifest_path_t *mps = talloc_malloc(count * sizeof(manifest_path_t));
+
+  args[0].type = 's';
+  args[0].str = bucket;
+
+  int l = snprintf(query, qlen,
+                   "SELECT path,md5,etag FROM s3_manifest "
+                   "WHERE bucket=? AND path IN (");
+  for(int i = 0; i < count; i++) {
+    l += snprintf(query + l, qlen - l, i ? ",?" : "?");
+    args[i + 1].type = 's';
+    args[i + 1].str = puts[i].path;
+    mps[i].mp_path = puts[i].path;
+    mps[i].mp_index = i;
+  }
+  snprintf(query + l, qlen - l, ")");
+
+  qsort(mps, count, sizeof(manifest_path_t), manifest_path_cmp);
+
+  scoped_db_stmt(s, query);
+  if(s == NULL || db_stmt_execa(s, count + 1, args))
+    return;
+
+  while(1) {
+    char dbpath[PATH_MAX];
+    char hash[64];
+    char etag[64];
+    if(db_stream_row(0, s,
+                     DB_RESULT_STRING(dbpath),
+                     DB_RESULT_STRING(hash),
+                     DB_RESULT_STRING(etag)))
+      break;
+
+    manifest_path_t key = {.mp_path = dbpath};
+    const manifest_path_t *mp = bsearch(&key, mps, count,
+                                        sizeof(manifest_path_t),
+                                        manifest_path_cmp);
+    if(mp == NULL)
+      continue;
+
+    const int i = mp->mp_index;
+    if(!strcmp(hash, md5[i]) && !strcmp(etag, md5[i]))
+      skip[i] = 1;
+  }
+}
+
+
+/**
+ * Store manifest files, S3 uploads are done in parallel
+ *
+ * The result of each write ends up in mf_err
+ */
+static void
+store_manifests(releasemaker_t *rm, manifest_file_t *files, int count)
 {
-  int err;
   const char *manifestdir = cfg_get_str(rm->rt_cfg, CFG("manifestDir"), NULL);
   project_t *p = rm->p;
   char path[PATH_MAX];
+
   if(manifestdir == NULL) {
     plog(p, "release/info/all", "No manifestDir configured");
-    return EINVAL;
+    for(int i = 0; i < count; i++)
+      files[i].mf_err = EINVAL;
+    return;
   }
 
-  char *json = htsmsg_json_serialize_to_str(m, 1);
-
   if(!strncmp(manifestdir, "s3://", strlen("s3://"))) {
     manifestdir += strlen("s3://");
 
@@ -65,121 +176,127 @@ write_manifest(releasemaker_t *rm, htsmsg_t *m, const char *name)
     const char *awsid  = cfg_get_str(rm->pc, CFG("s3", "awsid"),  NULL);
 
     if(bucket == NULL || secret == NULL || awsid == NULL) {
-      free(json);
-      return EINVAL;
+      for(int i = 0; i < count; i++)
+        files[i].mf_err = EINVAL;
+      return;
     }
 
-    snprintf(path, sizeof(path), "%s/%s", manifestdir, name);
-
-    char errbuf[512];
-
-    int r = aws_s3_put_file(bucket, awsid, secret, path,
-                            errbuf, sizeof(errbuf), json, strlen(json),
-                            "application/json");
-    free(json);
-    if(r) {
-      plog(p, "storage/s3", "Unable to upload %s -- %s", path, errbuf);
-      return EIO;
+    aws_s3_put_t *s3puts = talloc_zalloc(count * sizeof(aws_s3_put_t));
+    char (*md5)[33] = talloc_malloc(count * sizeof(md5[0]));
+    int *slot = talloc_malloc(count * sizeof(int));
+    int *skip = talloc_zalloc(count * sizeof(int));
+
+    for(int i = 0; i < count; i++) {
+      char *dst = talloc_malloc(PATH_MAX);
+      snprintf(dst, PATH_MAX, "%s/%s", manifestdir, files[i].mf_name);
+      s3puts[i].path = dst;
+      s3puts[i].data = files[i].mf_json;
+      s3puts[i].len = strlen(files[i].mf_json);
+      s3puts[i].content_type = "application/json";
+      manifest_md5(md5[i], files[i].mf_json, s3puts[i].len);
     }
-    return 0;
-
-  } else {
-    makedirs(manifestdir);
-    snprintf(path, sizeof(path), "%s/%s", manifestdir, name);
-
-    err = writefile(path, json, strlen(json));
-  }
-
-  free(json);
-  return err;
-}
 
+    // Skip everything whose content matches what we uploaded last time.
+    // This only knows about our own uploads, an object modified in S3
+    // by someone else is not uploaded again until the manifest changes
 
+    db_conn_t *c = db_get_conn();
+    if(c != NULL)
+      s3_manifests_unchanged(bucket, s3puts, md5, skip, count);
 
+    int n = 0;
+    for(int i = 0; i < count; i++) {
+      if(skip[i]) {
+        files[i].mf_err = WRITEFILE_NO_CHANGE;
+        continue;
+      }
+      slot[n] = i;
+      s3puts[n] = s3puts[i];
+      n++;
+    }
 
-/**
- * Given a project + commit OID and a target, open
- * Manifests/<target>.json and return it
- *
- * This should use common stuff from git.c instead
- */
-static htsmsg_t *
-get_embedded_manifest(project_t *p, const char *target,
-                      const git_oid *oid, const char *logctx)
-{
-  git_tree *tree = NULL;
-  git_commit *commit = NULL;
-  git_object *manifests = NULL;
-  git_object *blob = NULL;
-  const git_tree_entry *e;
+    if(n == 0)
+      return;
 
-  htsmsg_t *r = NULL;
+    aws_s3_put_files(bucket, awsid, secret, s3puts, n,
+                     cfg_get_int(rm->rt_cfg, CFG("parallelUploads"), 8));
 
-  scoped_lock(&p->p_repo_mutex);
+    db_stmt_t *s = c != NULL ? db_stmt_get(c, SQL_SET_S3_MANIFEST) : NULL;
 
-  if(git_commit_lookup(&commit, p->p_repo, oid)) {
-    plog(p, logctx, "Unable to lookup commit id when looking for manifest");
-    return NULL;
+    for(int j = 0; j < n; j++) {
+      const int i = slot[j];
+      files[i].mf_err = s3puts[j].error ? EIO : 0;
+      if(s3puts[j].error) {
+        plog(p, "storage/s3", "Unable to upload %s -- %s",
+             s3puts[j].path, s3puts[j].errbuf);
+        continue;
+      }
+      if(s != NULL)
+        db_stmt_exec(s, "ssss", bucket, s3puts[j].path, md5[i],
+                     s3puts[j].etag);
+    }
+    return;
   }
 
-  if(git_commit_tree(&tree, commit)) {
-    plog(p, logctx, "Unable to open git tree when looking for manifest");
-    goto cleanup;
+  makedirs(manifestdir);
+  for(int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/%s", manifestdir, files[i].mf_name);
+    files[i].mf_err = writefile(path, files[i].mf_json,
+                                strlen(files[i].mf_json));
   }
+}
 
-  if((e = git_tree_entry_byname(tree, "Manifests")) == NULL)  {
-    plog(p, logctx, "Manifests directory not found");
-    goto cleanup;
-  }
 
-  if(git_tree_entry_to_object(&manifests, p->p_repo, e)) {
-    plog(p, logctx, "Unable to lookup manifest tree object");
-    goto cleanup;
-  }
+/**
+ * Write manifest files and publish the ones that made it to storage
+ * so the REST API can serve them, see manifestcache.c
+ */
+static void
+write_manifests(releasemaker_t *rm, manifest_file_t *files, int count)
+{
+  store_manifests(rm, files, count);
 
-  if(git_object_type(manifests) != GIT_OBJ_TREE) {
-    plog(p, logctx, "Manifests/ is not a tree object");
-    goto cleanup;
+  for(int i = 0; i < count; i++) {
+    if(!files[i].mf_err || files[i].mf_err == WRITEFILE_NO_CHANGE)
+      manifestcache_publish(rm->p->p_id, files[i].mf_name, files[i].mf_json);
   }
+}
 
-  char filename[128];
-  snprintf(filename, sizeof(filename), "%s.json", target);
-
-  if((e = git_tree_entry_byname((git_tree *)manifests, filename)) == NULL)  {
-    plog(p, logctx, "%s not found", filename);
-    goto cleanup;
-  }
 
-  if(git_tree_entry_to_object(&blob, p->p_repo, e)) {
-    plog(p, logctx, "Unable to lookup %s object", filename);
-    goto cleanup;
-  }
+/**
+ * Write a manifest file
+ */
+static int
+write_manifest(releasemaker_t *rm, htsmsg_t *m, const char *name)
+{
+  manifest_file_t mf = {
+    .mf_name = name,
+    .mf_json = htsmsg_json_serialize_to_str(m, 1),
+  };
+  write_manifests(rm, &mf, 1);
+  free(mf.mf_json);
+  return mf.mf_err;
+}
 
-  if(git_object_type(blob) != GIT_OBJ_BLOB) {
-    plog(p, logctx, "%s is not a file", filename);
-    goto cleanup;
-  }
 
 
-  size_t size = git_blob_rawsize((git_blob *)blob);
-  char *data = talloc_malloc(size + 1);
-  memcpy(data, git_blob_rawcontent((git_blob *)blob), size);
-  data[size] = 0;
 
+/**
+ * Given a project + commit OID and a target, open
+ * Manifests/<target>.json and return it
+ */
+static htsmsg_t *
+get_embedded_manifest(project_t *p, const char *target,
+                      const git_oid *oid, const char *logctx)
+{
+  char path[256];
   char errbuf[512];
 
-  r = htsmsg_json_deserialize(data, errbuf, sizeof(errbuf));
-  if(r == NULL)
-    plog(p, logctx, "Unable to decode JSON in '%s' -- %s", filename, errbuf);
-
+  snprintf(path, sizeof(path), "Manifests/%s.json", target);
 
- cleanup:
-  git_object_free(blob);
-  git_object_free(manifests);
-  if(tree != NULL)
-    git_tree_free(tree);
-  if(commit != NULL)
-    git_commit_free(commit);
+  htsmsg_t *r = git_get_json(p, oid, path, errbuf, sizeof(errbuf));
+  if(r == NULL)
+    plog(p, logctx, "Unable to load manifest -- %s", errbuf);
   return r;
 }
 
@@ -220,24 +337,57 @@ releasemaker_init(releasemaker_t *rm, project_t *p, cfg_t *pc)
 }
 
 
+#define SEARCH_DEPTH    100  // Number of revisions to look for builds in
+#define REVHASH_SIZE    256
+
+/**
+ * A successful build of one of the revisions we're looking at
+ */
+typedef struct rev_build {
+  struct rev_build *rb_next;
+  int rb_id;
+  char rb_target[64];
+  char rb_version[64];
+} rev_build_t;
+
+typedef struct search_rev {
+  git_oid sr_oid;
+  char sr_oidtxt[41];
+  int sr_hash_next;            // Index of next revision in bucket, or -1
+  rev_build_t *sr_builds;      // In descending build id order
+  rev_build_t **sr_builds_tail;
+} search_rev_t;
+
+
+/**
+ *
+ */
+static unsigned int
+revhash(const char *oidtxt)
+{
+  unsigned int h = 0;
+  for(int i = 0; i < 8 && oidtxt[i]; i++)
+    h = h * 31 + oidtxt[i];
+  return h & (REVHASH_SIZE - 1);
+}
+
+
 /**
  * Given a Git revision (OID) we walk the tree and try to find
  * a successful build matching the revision
+ *
+ * All builds of the walked revisions are fetched with a single query
  */
 static int
-find_successful_build(releasemaker_t *rm, git_oid *start_oid, 
+find_successful_build(releasemaker_t *rm, const git_oid *start_oid,
 		      const char *branch)
 {
-  char oidtxt[41];
   git_oid oid;
   git_revwalk *walk;
   project_t *p = rm->p;
-  db_conn_t *c = db_get_conn();
   build_t *b;
-
-  if(c == NULL)
-    return DOOZER_ERROR_TRANSIENT;
-
+  int revhash_heads[REVHASH_SIZE];
+  int numtargets = 0;
 
   struct build_queue tentative_builds;
   TAILQ_INIT(&tentative_builds);
@@ -255,66 +405,133 @@ find_successful_build(releasemaker_t *rm, git_oid *start_oid,
     snprintf(b->b_target, sizeof(b->b_target), "%s", t_name);
     snprintf(b->b_branch, sizeof(b->b_branch), "%s", branch);
     TAILQ_INSERT_TAIL(&tentative_builds, b, b_global_link);
+    numtargets++;
+  }
+
+  if(numtargets == 0)
+    return 0;
+
+  search_rev_t *revs = talloc_malloc(SEARCH_DEPTH * sizeof(search_rev_t));
+  int numrevs = 0;
+
+  memset(revhash_heads, 0xff, sizeof(revhash_heads));
+
+  {
+    scoped_git_reader(gr, p);
+    if(gr.repo == NULL)
+      return DOOZER_ERROR_TRANSIENT;
+    git_revwalk_new(&walk, gr.repo);
+    git_revwalk_push(walk, start_oid);
+    git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
+
+    while(numrevs < SEARCH_DEPTH && !git_revwalk_next(&oid, walk)) {
+      search_rev_t *sr = &revs[numrevs];
+      git_oid_cpy(&sr->sr_oid, &oid);
+      git_oid_fmt(sr->sr_oidtxt, &oid);
+      sr->sr_oidtxt[40] = 0;
+      sr->sr_builds = NULL;
+      sr->sr_builds_tail = &sr->sr_builds;
+
+      unsigned int h = revhash(sr->sr_oidtxt);
+      sr->sr_hash_next = revhash_heads[h];
+      revhash_heads[h] = numrevs;
+      numrevs++;
+    }
+    git_revwalk_free(walk);
   }
 
+  if(numrevs == 0)
+    return 0;
 
-  scoped_lock(&p->p_repo_mutex);
-  git_revwalk_new(&walk, p->p_repo);
-  git_revwalk_push(walk, start_oid);
-  git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL);
-  oidtxt[40] = 0;
+  size_t qlen = 256 + numrevs * 2;
+  char *query = talloc_malloc(qlen);
+  int l = snprintf(query, qlen,
+                   "SELECT id,target,version,revision "
+                   "FROM build "
+                   "WHERE project=? "
+                   "AND status='done' "
+                   "AND revision IN (");
+  for(int i = 0; i < numrevs; i++)
+    l += snprintf(query + l, qlen - l, i ? ",?" : "?");
+  snprintf(query + l, qlen - l, ") ORDER BY id DESC");
+
+  db_args_t args[numrevs + 1];
+  args[0].type = 's';
+  args[0].str = p->p_id;
+  for(int i = 0; i < numrevs; i++) {
+    args[i + 1].type = 's';
+    args[i + 1].str = revs[i].sr_oidtxt;
+  }
 
-  db_stmt_t *s = db_stmt_get(c,
-			      "SELECT id,target,version "
-			      "FROM build "
-			      "WHERE revision=? "
-			      "AND project=? "
-			      "AND status=? "
-                              "ORDER BY id DESC");
+  scoped_db_stmt(s, query);
+  if(s == NULL || db_stmt_execa(s, numrevs + 1, args))
+    return DOOZER_ERROR_TRANSIENT;
 
-  int cnt = 0;
+  while(1) {
+    rev_build_t *rb = talloc_malloc(sizeof(rev_build_t));
+    char revision[64];
 
-  while(!git_revwalk_next(&oid, walk)) {
-    cnt++;
-    if(cnt == 100)
+    int r = db_stream_row(0, s,
+                          DB_RESULT_INT(rb->rb_id),
+                          DB_RESULT_STRING(rb->rb_target),
+                          DB_RESULT_STRING(rb->rb_version),
+                          DB_RESULT_STRING(revision));
+    if(r < 0)
+      return DOOZER_ERROR_TRANSIENT;
+    if(r)
       break;
 
-    git_oid_fmt(oidtxt, &oid);
-    if(db_stmt_exec(s, "sss", oidtxt, p->p_id, "done"))
-      goto bad;
+    int i = revhash_heads[revhash(revision)];
+    for(; i != -1; i = revs[i].sr_hash_next)
+      if(!strcmp(revs[i].sr_oidtxt, revision))
+        break;
+    if(i == -1)
+      continue;
 
-    while(1) {
-      int id;
-      char target[64];
-      char version[64];
+    rb->rb_next = NULL;
+    *revs[i].sr_builds_tail = rb;
+    revs[i].sr_builds_tail = &rb->rb_next;
+  }
 
-      int r = db_stream_row(0, s, 
-			    DB_RESULT_INT(id),
-			    DB_RESULT_STRING(target),
-			    DB_RESULT_STRING(version));
-      if(r < 0) 
-	goto bad;
+  // Pick the build closest to the branch tip for each target.
+  // Builds of older versions further down the branch history are
+  // remembered so patches can be precomputed from them
 
-      if(r)
-	break;
+  build_t *picked[numtargets];
+  const char *lastversion[numtargets];
+  int numpicked = 0;
+
+  for(int i = 0; i < numrevs; i++) {
+    for(const rev_build_t *rb = revs[i].sr_builds; rb; rb = rb->rb_next) {
 
       TAILQ_FOREACH(b, &tentative_builds, b_global_link) {
-	if(!strcmp(b->b_target, target))
+	if(!strcmp(b->b_target, rb->rb_target))
 	  break;
       }
 
       if(b != NULL) {
-	b->b_id = id;
+	b->b_id = rb->rb_id;
+	b->b_num_prev = 0;
 
-        git_oid_cpy(&b->b_oid, &oid);
-	strcpy(b->b_version, version);
+        git_oid_cpy(&b->b_oid, &revs[i].sr_oid);
+	strcpy(b->b_version, rb->rb_version);
 	TAILQ_REMOVE(&tentative_builds, b, b_global_link);
 	TAILQ_INSERT_TAIL(&rm->builds, b, b_global_link);
+	lastversion[numpicked] = b->b_version;
+	picked[numpicked++] = b;
+	continue;
       }
-    }
 
-    if(TAILQ_FIRST(&tentative_builds) == NULL)
-      break;
+      for(int j = 0; j < numpicked; j++) {
+	b = picked[j];
+	if(strcmp(b->b_target, rb->rb_target) ||
+	   b->b_num_prev == BUILD_MAX_PREVIOUS ||
+	   !strcmp(lastversion[j], rb->rb_version))
+	  continue;
+	b->b_prev_ids[b->b_num_prev++] = rb->rb_id;
+	lastversion[j] = rb->rb_version;
+      }
+    }
   }
 
   TAILQ_FOREACH(b, &tentative_builds, b_global_link) {
@@ -323,12 +540,7 @@ find_successful_build(releasemaker_t *rm, git_oid *start_oid,
     plog(rm->p, logctx, "No build for target %s in %s", b->b_target,
 	 branch);
   }
-
-  git_revwalk_free(walk);
   return 0;
- bad:
-  git_revwalk_free(walk);
-  return DOOZER_ERROR_TRANSIENT;
 }
 
 
@@ -341,15 +553,16 @@ find_successful_build(releasemaker_t *rm, git_oid *start_oid,
 static int
 find_successful_builds(releasemaker_t *rm)
 {
-  struct ref_list refs;
-  ref_t *r;
+  const ref_t *r;
 
   /**
-   * git_repo_list_branches() returns the ref names in descending
+   * git_repo_branches() returns the ref names in descending
    * dictionary order (so 4.3 comes before 4.1, etc)
    */
 
-  git_repo_list_branches(rm->p, &refs);
+  scoped_ref_snapshot(rs, rm->p);
+  if(rs == NULL)
+    return DOOZER_ERROR_TRANSIENT;
 
   htsmsg_field_t *f;
   HTSMSG_FOREACH(f, rm->tracks_cfg) {
@@ -361,9 +574,12 @@ find_successful_builds(releasemaker_t *rm)
     if(pattern == NULL)
       continue;
 
-    LIST_FOREACH(r, &refs, link) {
-      if(!fnmatch(pattern, r->name, FNM_PATHNAME))
+    r = NULL;
+    for(int i = 0; i < rs->rs_count; i++) {
+      if(!fnmatch(pattern, rs->rs_refs[i].name, FNM_PATHNAME)) {
+	r = &rs->rs_refs[i];
 	break;
+      }
     }
 
     if(r == NULL) {
@@ -373,7 +589,6 @@ find_successful_builds(releasemaker_t *rm)
     }
     find_successful_build(rm, &r->oid, r->name);
   }
-  git_repo_free_refs(&refs);
   return 0;
 }
 
@@ -391,32 +606,54 @@ releasemaker_list_builds(releasemaker_t *rm)
 
   find_successful_builds(rm);
 
-  db_conn_t *c = db_get_conn();
-
-  if(c == NULL)
-    return DOOZER_ERROR_TRANSIENT;
+  // Get the artifacts of all builds in one go
 
+  int numbuilds = 0;
   TAILQ_FOREACH(b, &rm->builds, b_global_link) {
+    TAILQ_INIT(&b->b_artifacts);
+    numbuilds++;
+  }
 
-    db_stmt_t *s = db_stmt_get(c, SQL_GET_ARTIFACTS);
-
-    if(db_stmt_exec(s, "i", b->b_id))
+  if(numbuilds > 0) {
+    size_t qlen = 256 + numbuilds * 12;
+    char *query = talloc_malloc(qlen);
+    int l = snprintf(query, qlen,
+                     "SELECT build_id,id,type,sha1,size,name "
+                     "FROM artifact "
+                     "WHERE build_id IN (");
+    TAILQ_FOREACH(b, &rm->builds, b_global_link)
+      l += snprintf(query + l, qlen - l, "%s%d",
+                    b == TAILQ_FIRST(&rm->builds) ? "" : ",", b->b_id);
+    snprintf(query + l, qlen - l, ") ORDER BY id");
+
+    scoped_db_stmt(s, query);
+    if(s == NULL || db_stmt_exec(s, ""))
       return DOOZER_ERROR_TRANSIENT;
 
-    TAILQ_INIT(&b->b_artifacts);
     while(1) {
-      artifact_t *a = talloc_malloc(sizeof(artifact_t));
+      artifact_t a;
+      int build_id;
       int r = db_stream_row(0, s,
-                            DB_RESULT_INT(a->a_id),
-                            DB_RESULT_STRING(a->a_type),
-                            DB_RESULT_STRING(a->a_sha1),
-                            DB_RESULT_INT(a->a_size),
-                            DB_RESULT_STRING(a->a_name));
+                            DB_RESULT_INT(build_id),
+                            DB_RESULT_INT(a.a_id),
+                            DB_RESULT_STRING(a.a_type),
+                            DB_RESULT_STRING(a.a_sha1),
+                            DB_RESULT_INT(a.a_size),
+                            DB_RESULT_STRING(a.a_name));
       if(r < 0)
         return DOOZER_ERROR_TRANSIENT;
       if(r)
         break;
-      TAILQ_INSERT_HEAD(&b->b_artifacts, a, a_link);
+
+      // The same build may have been picked for several tracks
+
+      TAILQ_FOREACH(b, &rm->builds, b_global_link) {
+        if(b->b_id != build_id)
+          continue;
+        artifact_t *ac = talloc_malloc(sizeof(artifact_t));
+        *ac = a;
+        TAILQ_INSERT_HEAD(&b->b_artifacts, ac, a_link);
+      }
     }
   }
 
@@ -439,6 +676,519 @@ releasemaker_list_builds(releasemaker_t *rm)
 }
 
 
+/**
+ * Queue generation of patches from the artifacts of the last few
+ * versions built on the same branch to a freshly published build, so
+ * the patchstash is warm when clients start to upgrade
+ */
+static void
+precompute_patches(releasemaker_t *rm, const build_t *b, const char *logctx)
+{
+  const artifact_t *a;
+  int versions =
+    cfg_get_int(rm->rt_cfg, CFG("patchPrecompute", "versions"), 3);
+  const int zstd =
+    cfg_get_int(rm->rt_cfg, CFG("patchPrecompute", "zstd"), 0);
+
+  if(versions > b->b_num_prev)
+    versions = b->b_num_prev;
+  if(versions <= 0)
+    return;
+
+  size_t qlen = 256 + versions * 12;
+  char *query = talloc_malloc(qlen);
+  int l = snprintf(query, qlen,
+                   "SELECT sha1 "
+                   "FROM artifact "
+                   "WHERE type=? "
+                   "AND storage='file' "
+                   "AND build_id IN (");
+  for(int i = 0; i < versions; i++)
+    l += snprintf(query + l, qlen - l, "%s%d", i ? "," : "",
+                  b->b_prev_ids[i]);
+  snprintf(query + l, qlen - l, ")");
+
+  TAILQ_FOREACH(a, &b->b_artifacts, a_link) {
+    scoped_db_stmt(s, query);
+    if(s == NULL || db_stmt_exec(s, "s", a->a_type))
+      return;
+
+    int count = 0;
+    while(1) {
+      char sha1[64];
+      int r = db_stream_row(0, s, DB_RESULT_STRING(sha1));
+      if(r < 0)
+        return;
+      if(r)
+        break;
+      if(!strcmp(sha1, a->a_sha1))
+        continue;
+      artifact_serve_precompute_patch(sha1, a->a_sha1,
+                                      BSDIFF_COMPRESS_BZIP2);
+      if(zstd)
+        artifact_serve_precompute_patch(sha1, a->a_sha1,
+                                        BSDIFF_COMPRESS_ZSTD);
+      count++;
+    }
+
+    if(count)
+      plog(rm->p, logctx,
+           "Queued %d patch%s to %s %s (%s)",
+           count, count == 1 ? "" : "es", b->b_version, a->a_type,
+           a->a_sha1);
+  }
+}
+
+
+/**
+ * Fingerprints of everything that went into each track/target manifest
+ * (and all.json) the last time it was written. If nothing has changed
+ * there is no need to generate it again.
+ */
+
+LIST_HEAD(release_fp_list, release_fp);
+
+typedef struct release_fp {
+  LIST_ENTRY(release_fp) rf_link;
+  char *rf_track;
+  char *rf_target;
+  uint64_t rf_fingerprint;
+  htsmsg_t *rf_out_all;  // Our entry in all.json, NULL if none
+  int rf_mark;           // Not seen during the current pass
+} release_fp_t;
+
+typedef struct release_cache {
+  struct release_fp_list rc_fps;
+  uint64_t rc_all_fingerprint;
+} release_cache_t;
+
+#define FP_INIT 14695981039346656037ULL
+
+
+/**
+ *
+ */
+static uint64_t
+fp_bytes(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *d = data;
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ d[i]) * 1099511628211ULL;
+  return h;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+fp_str(uint64_t h, const char *str)
+{
+  if(str == NULL)
+    return fp_bytes(h, "\xff", 1);
+  return fp_bytes(h, str, strlen(str) + 1);
+}
+
+
+/**
+ *
+ */
+static uint64_t
+fp_u64(uint64_t h, uint64_t v)
+{
+  return fp_bytes(h, &v, sizeof(v));
+}
+
+
+/**
+ *
+ */
+static release_cache_t *
+release_cache_get(project_t *p)
+{
+  if(p->p_release_cache == NULL)
+    p->p_release_cache = calloc(1, sizeof(release_cache_t));
+  return p->p_release_cache;
+}
+
+
+/**
+ *
+ */
+static release_fp_t *
+release_fp_get(project_t *p, const char *track, const char *target)
+{
+  release_cache_t *rc = release_cache_get(p);
+  release_fp_t *rf;
+
+  LIST_FOREACH(rf, &rc->rc_fps, rf_link) {
+    if(!strcmp(rf->rf_track, track) && !strcmp(rf->rf_target, target)) {
+      rf->rf_mark = 0;
+      return rf;
+    }
+  }
+
+  rf = calloc(1, sizeof(release_fp_t));
+  rf->rf_track = strdup(track);
+  rf->rf_target = strdup(target);
+  LIST_INSERT_HEAD(&rc->rc_fps, rf, rf_link);
+  return rf;
+}
+
+
+/**
+ * Mark all fingerprints, release_fp_get() unmarks the ones still in use
+ */
+static void
+release_fp_mark(project_t *p)
+{
+  release_cache_t *rc = release_cache_get(p);
+  release_fp_t *rf;
+
+  LIST_FOREACH(rf, &rc->rc_fps, rf_link)
+    rf->rf_mark = 1;
+}
+
+
+/**
+ * Forget fingerprints of tracks and targets that are no longer around
+ */
+static void
+release_fp_sweep(project_t *p)
+{
+  release_cache_t *rc = release_cache_get(p);
+  release_fp_t *rf, *next;
+
+  for(rf = LIST_FIRST(&rc->rc_fps); rf != NULL; rf = next) {
+    next = LIST_NEXT(rf, rf_link);
+    if(!rf->rf_mark)
+      continue;
+    LIST_REMOVE(rf, rf_link);
+    if(rf->rf_out_all != NULL)
+      htsmsg_destroy(rf->rf_out_all);
+    free(rf->rf_track);
+    free(rf->rf_target);
+    free(rf);
+  }
+}
+
+
+/**
+ * Drop all fingerprints so everything is generated again, used when
+ * the project config has changed
+ */
+void
+releasemaker_flush_cache(project_t *p)
+{
+  if(p->p_release_cache == NULL)
+    return;
+  release_fp_mark(p);
+  release_fp_sweep(p);
+  free(p->p_release_cache);
+  p->p_release_cache = NULL;
+}
+
+
+/**
+ * Fingerprint where manifests end up, so changing the destination
+ * writes everything there again
+ */
+static uint64_t
+dest_fingerprint(releasemaker_t *rm)
+{
+  uint64_t h = FP_INIT;
+  h = fp_str(h, cfg_get_str(rm->rt_cfg, CFG("manifestDir"), NULL));
+  return fp_str(h, cfg_get_str(rm->pc, CFG("s3", "bucket"), NULL));
+}
+
+
+/**
+ * Returns true if a manifest we wrote to a local manifestDir has since
+ * been removed. Nothing is checked for S3
+ */
+static int
+manifest_missing(releasemaker_t *rm, const char *name)
+{
+  const char *manifestdir = cfg_get_str(rm->rt_cfg, CFG("manifestDir"), NULL);
+  char path[PATH_MAX];
+
+  if(manifestdir == NULL || !strncmp(manifestdir, "s3://", strlen("s3://")))
+    return 0;
+
+  snprintf(path, sizeof(path), "%s/%s", manifestdir, name);
+  return access(path, F_OK) != 0;
+}
+
+
+/**
+ * Fingerprint the inputs of a track/target manifest: The chosen build
+ * and its artifacts, the manifest blob, what the changelog is made of
+ * and the config that ends up in the output
+ */
+static uint64_t
+target_fingerprint(releasemaker_t *rm, const build_t *b,
+                   const char *trackid, const char *tracktitle,
+                   const char *t_title, const char *baseurl,
+                   cfg_t *artifacts_cfg, uint64_t tagfp, uint64_t destfp)
+{
+  project_t *p = rm->p;
+  const artifact_t *a;
+  char path[256];
+  char errbuf[512];
+  git_oid oid;
+  uint64_t h = FP_INIT;
+
+  h = fp_str(h, trackid);
+  h = fp_str(h, tracktitle);
+  h = fp_str(h, t_title);
+  h = fp_str(h, baseurl);
+  h = fp_u64(h, destfp);
+
+  h = fp_u64(h, b->b_id);
+  h = fp_bytes(h, b->b_oid.id, GIT_OID_RAWSZ);
+  h = fp_str(h, b->b_branch);
+  h = fp_str(h, b->b_version);
+
+  TAILQ_FOREACH(a, &b->b_artifacts, a_link) {
+    h = fp_u64(h, a->a_id);
+    h = fp_str(h, a->a_type);
+    h = fp_str(h, a->a_sha1);
+    h = fp_str(h, a->a_name);
+    h = fp_u64(h, a->a_size);
+  }
+
+  htsmsg_field_t *f;
+  HTSMSG_FOREACH(f, artifacts_cfg) {
+    htsmsg_t *am = htsmsg_get_map_by_field(f);
+    h = fp_str(h, am ? cfg_get_str(am, CFG("type"), NULL) : NULL);
+    h = fp_str(h, am ? cfg_get_str(am, CFG("title"), NULL) : NULL);
+  }
+
+  snprintf(path, sizeof(path), "Manifests/%s.json", b->b_target);
+  if(git_get_blob_oid(p, &b->b_oid, path, &oid, errbuf, sizeof(errbuf)))
+    memset(&oid, 0, sizeof(oid));
+  h = fp_bytes(h, oid.id, GIT_OID_RAWSZ);
+
+  // The changelog is made from notes and versions derived from tags
+
+  if(git_repo_resolve_ref(p, "refs/notes/changelog", &oid))
+    memset(&oid, 0, sizeof(oid));
+  h = fp_bytes(h, oid.id, GIT_OID_RAWSZ);
+
+  snprintf(path, sizeof(path), "refs/notes/changelog-%s", b->b_target);
+  if(git_repo_resolve_ref(p, path, &oid))
+    memset(&oid, 0, sizeof(oid));
+  h = fp_bytes(h, oid.id, GIT_OID_RAWSZ);
+
+  return fp_u64(h, tagfp);
+}
+
+
+/**
+ * A track/target manifest that needs to be generated
+ */
+typedef struct release_job {
+  releasemaker_t *rj_rm;
+  const build_t *rj_build;
+  const char *rj_trackid;
+  const char *rj_tracktitle;
+  const char *rj_title;          // Target title
+  const char *rj_baseurl;
+  cfg_t *rj_artifacts_cfg;
+  char rj_logctx[128];
+
+  release_fp_t *rj_rf;
+  uint64_t rj_fingerprint;
+
+  char rj_name[128];
+  manifest_file_t *rj_file;      // The <track>-<target>.json
+  htsmsg_t *rj_out_all;          // Entry in all.json, NULL if none
+} release_job_t;
+
+
+/**
+ * Generate the manifest for a single track+target and its entry in
+ * all.json. Runs on the release workers, so only things safe to do
+ * from any thread are allowed in here.
+ */
+static void
+release_job_run(release_job_t *rj)
+{
+  const build_t *b = rj->rj_build;
+  const artifact_t *a;
+  project_t *p = rj->rj_rm->p;
+
+  htsmsg_t *manifest = get_embedded_manifest(p, b->b_target, &b->b_oid,
+                                             rj->rj_logctx);
+
+  htsmsg_t *out_single = htsmsg_create_map(); // For a single track+target
+
+  htsmsg_add_str(out_single, "arch",    b->b_target);
+  htsmsg_add_str(out_single, "title",   rj->rj_title);
+  htsmsg_add_str(out_single, "version", b->b_version);
+  htsmsg_add_str(out_single, "branch",  b->b_branch);
+
+  int out_all_got_artifacts = 0;
+
+  htsmsg_t *out_all = htsmsg_copy(out_single); // For all.json
+
+  htsmsg_t *artifacts_single = htsmsg_create_list();
+  htsmsg_t *artifacts_all    = htsmsg_create_list();
+
+  htsmsg_field_t *afield;
+  HTSMSG_FOREACH(afield, rj->rj_artifacts_cfg) {
+    htsmsg_t *am = htsmsg_get_map_by_field(afield);
+    const char *amtype = cfg_get_str(am, CFG("type"), NULL);
+    if(amtype == NULL)
+      continue;
+    const char *amtitle = cfg_get_str(am, CFG("title"), NULL);
+
+    TAILQ_FOREACH(a, &b->b_artifacts, a_link) {
+      if(!strcmp(a->a_type, amtype)) {
+
+        htsmsg_t *artifact = htsmsg_create_map();
+        char url[1024];
+
+        htsmsg_add_str(artifact, "type", a->a_type);
+        htsmsg_add_str(artifact, "name", a->a_name);
+        htsmsg_add_str(artifact, "sha1", a->a_sha1);
+        htsmsg_add_u32(artifact, "size", a->a_size);
+        snprintf(url, sizeof(url), "%s/file/%s", rj->rj_baseurl, a->a_sha1);
+        htsmsg_add_str(artifact, "url", url);
+
+        // We only want to include artifacts with a title in all.json
+
+        htsmsg_add_msg(artifacts_single, NULL, htsmsg_copy(artifact));
+
+        if(amtitle != NULL) {
+          htsmsg_add_str(artifact, "title", amtitle);
+          htsmsg_add_msg(artifacts_all, NULL, artifact);
+          out_all_got_artifacts = 1;
+        } else {
+          htsmsg_destroy(artifact);
+        }
+      }
+    }
+  }
+
+  htsmsg_add_msg(out_single, "artifacts", artifacts_single);
+  htsmsg_add_msg(out_all,    "artifacts", artifacts_all);
+
+  if(manifest != NULL) {
+    htsmsg_add_msg(out_single, "manifest", htsmsg_copy(manifest));
+    htsmsg_add_msg(out_all,    "manifest", manifest);
+  }
+
+  struct change_queue cq;
+  if(!git_changelog(&cq, p, &b->b_oid, 0, 100, 0, b->b_target)) {
+    htsmsg_t *changelog = htsmsg_create_list();
+    change_t *c;
+    TAILQ_FOREACH(c, &cq, link) {
+      htsmsg_t *e = htsmsg_create_map();
+      htsmsg_add_str(e, "version", c->version);
+      htsmsg_add_str(e, "desc", c->msg);
+      htsmsg_add_msg(changelog, NULL, e);
+    }
+    htsmsg_add_msg(out_single, "changelog", changelog);
+    git_changlog_free(&cq);
+  }
+
+  snprintf(rj->rj_name, sizeof(rj->rj_name), "%s-%s.json",
+           rj->rj_trackid, b->b_target);
+
+  rj->rj_file->mf_name = rj->rj_name;
+  rj->rj_file->mf_json = htsmsg_json_serialize_to_str(out_single, 1);
+  htsmsg_destroy(out_single);
+
+  // Only add to all.json if the target had any artifacts at all
+
+  if(out_all_got_artifacts) {
+    rj->rj_out_all = out_all;
+  } else {
+    htsmsg_destroy(out_all);
+  }
+}
+
+
+typedef struct release_pool {
+  pthread_mutex_t rp_mutex;
+  release_job_t *rp_jobs;
+  int rp_num_jobs;
+  int rp_next;
+} release_pool_t;
+
+
+/**
+ *
+ */
+static void
+release_pool_work(release_pool_t *rp)
+{
+  while(1) {
+    pthread_mutex_lock(&rp->rp_mutex);
+    int i = rp->rp_next++;
+    pthread_mutex_unlock(&rp->rp_mutex);
+
+    if(i >= rp->rp_num_jobs)
+      return;
+    release_job_run(&rp->rp_jobs[i]);
+  }
+}
+
+
+/**
+ *
+ */
+static void *
+release_worker(void *aux)
+{
+  release_pool_work(aux);
+  talloc_cleanup();
+  return NULL;
+}
+
+
+/**
+ * Run all jobs on at most 'workers' threads (including the caller)
+ */
+static void
+release_jobs_run(release_job_t *jobs, int count, int workers)
+{
+  release_pool_t rp = {
+    .rp_jobs = jobs,
+    .rp_num_jobs = count,
+  };
+  pthread_mutex_init(&rp.rp_mutex, NULL);
+
+  if(workers > count)
+    workers = count;
+
+  pthread_t tids[workers > 1 ? workers - 1 : 1];
+  int started = 0;
+  for(int i = 0; i < workers - 1; i++)
+    if(!pthread_create(&tids[started], NULL, release_worker, &rp))
+      started++;
+
+  release_pool_work(&rp);
+
+  for(int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+
+  pthread_mutex_destroy(&rp.rp_mutex);
+}
+
+
+/**
+ * An entry in all.json, either generated by a job in this run or
+ * remembered from a previous one
+ */
+typedef struct release_slot {
+  int rs_track;
+  release_job_t *rs_job;
+  const htsmsg_t *rs_cached;
+} release_slot_t;
+
+
 /**
  *
  */
@@ -446,7 +1196,6 @@ static void
 generate_update_tracks(releasemaker_t *rm)
 {
   build_t *b;
-  artifact_t *a;
   target_t *t;
   char logctx[128];
   project_t *p = rm->p;
@@ -464,9 +1213,24 @@ generate_update_tracks(releasemaker_t *rm)
     }
   }
 
-  htsmsg_t *outtracks = htsmsg_create_list();
+  const uint64_t tagfp = git_repo_tags_fingerprint(p);
+  const uint64_t destfp = dest_fingerprint(rm);
+  uint64_t allfp = fp_u64(fp_str(FP_INIT, baseurl), destfp);
 
-  for(int i = 0; ; i++) {
+  const int max_slots = cfg_list_length(rm->tracks_cfg) * rm->num_targets;
+  release_slot_t *slots = talloc_zalloc(max_slots * sizeof(release_slot_t));
+  release_job_t *jobs = talloc_zalloc(max_slots * sizeof(release_job_t));
+  manifest_file_t *files = talloc_zalloc(max_slots * sizeof(manifest_file_t));
+  int num_slots = 0;
+  int num_jobs = 0;
+  int num_tracks;
+
+  release_fp_mark(p);
+
+  // Figure out what to generate
+
+  for(num_tracks = 0; ; num_tracks++) {
+    const int i = num_tracks;
     const char *trackid =
       cfg_get_str(rm->tracks_cfg, CFG(CFG_INDEX(i), "name"),   NULL);
     const char *tracktitle  =
@@ -480,7 +1244,9 @@ generate_update_tracks(releasemaker_t *rm)
     const char *desc =
       cfg_get_str(rm->tracks_cfg, CFG(CFG_INDEX(i), "description"), NULL);
 
-    htsmsg_t *outtargets = htsmsg_create_list();
+    allfp = fp_str(allfp, trackid);
+    allfp = fp_str(allfp, tracktitle);
+    allfp = fp_str(allfp, desc);
 
     htsmsg_field_t *tfield;
     HTSMSG_FOREACH(tfield, rm->targets_cfg) {
@@ -520,8 +1286,6 @@ generate_update_tracks(releasemaker_t *rm)
            "ReleaseTrack: %s Target %s: Using branch '%s' for pattern '%s'",
            trackid, t->t_target, b->b_branch, branchpattern);
 
-      htsmsg_t *manifest = get_embedded_manifest(p, t_name, &b->b_oid, logctx);
-
       cfg_t *artifacts_cfg = cfg_get_list(target, "artifacts");
 
       if(artifacts_cfg == NULL) {
@@ -530,103 +1294,120 @@ generate_update_tracks(releasemaker_t *rm)
         continue;
       }
 
-      htsmsg_t *out_single = htsmsg_create_map(); // For a single track+target
+      const uint64_t fp = target_fingerprint(rm, b, trackid, tracktitle,
+                                             t_title, baseurl,
+                                             artifacts_cfg, tagfp, destfp);
+      allfp = fp_u64(fp_str(allfp, t_name), fp);
 
-      htsmsg_add_str(out_single, "arch",    b->b_target);
-      htsmsg_add_str(out_single, "title",   t_title);
-      htsmsg_add_str(out_single, "version", b->b_version);
-      htsmsg_add_str(out_single, "branch",  b->b_branch);
+      if(num_slots == max_slots)
+        continue;
 
-      int out_all_got_artifacts = 0;
+      release_slot_t *rs = &slots[num_slots++];
+      rs->rs_track = i;
 
-      htsmsg_t *out_all = htsmsg_copy(out_single); // For all.json
+      char name[128];
+      snprintf(name, sizeof(name), "%s-%s.json", trackid, t_name);
 
-      htsmsg_t *artifacts_single = htsmsg_create_list();
-      htsmsg_t *artifacts_all    = htsmsg_create_list();
+      release_fp_t *rf = release_fp_get(p, trackid, t_name);
+      if(rf->rf_fingerprint == fp && !manifest_missing(rm, name)) {
+        rs->rs_cached = rf->rf_out_all;
+        continue;
+      }
 
-      htsmsg_field_t *afield;
-      HTSMSG_FOREACH(afield, artifacts_cfg) {
-        htsmsg_t *am = htsmsg_get_map_by_field(afield);
-        const char *amtype = cfg_get_str(am, CFG("type"), NULL);
-        if(amtype == NULL)
-          continue;
-        const char *amtitle = cfg_get_str(am, CFG("title"), NULL);
+      release_job_t *rj = &jobs[num_jobs];
+      rj->rj_rm = rm;
+      rj->rj_build = b;
+      rj->rj_trackid = trackid;
+      rj->rj_tracktitle = tracktitle;
+      rj->rj_title = t_title;
+      rj->rj_baseurl = baseurl;
+      rj->rj_artifacts_cfg = artifacts_cfg;
+      snprintf(rj->rj_logctx, sizeof(rj->rj_logctx), "%s", logctx);
+      rj->rj_rf = rf;
+      rj->rj_fingerprint = fp;
+      rj->rj_file = &files[num_jobs];
+      rs->rs_job = rj;
+      num_jobs++;
+    }
+  }
 
-        TAILQ_FOREACH(a, &b->b_artifacts, a_link) {
-          if(!strcmp(a->a_type, amtype)) {
+  // Generate and write the per track+target manifests
 
-            htsmsg_t *artifact = htsmsg_create_map();
-            char url[1024];
+  if(num_jobs > 0) {
+    release_jobs_run(jobs, num_jobs,
+                     cfg_get_int(rm->rt_cfg, CFG("workers"), 4));
 
-            htsmsg_add_str(artifact, "type", a->a_type);
-            htsmsg_add_str(artifact, "name", a->a_name);
-            htsmsg_add_str(artifact, "sha1", a->a_sha1);
-            htsmsg_add_u32(artifact, "size", a->a_size);
-            snprintf(url, sizeof(url), "%s/file/%s", baseurl, a->a_sha1);
-            htsmsg_add_str(artifact, "url", url);
+    write_manifests(rm, files, num_jobs);
+  }
 
-            // We only want to include artifacts with a title in all.json
+  for(int i = 0; i < num_jobs; i++) {
+    release_job_t *rj = &jobs[i];
+    const build_t *b = rj->rj_build;
+    int err = rj->rj_file->mf_err;
 
-            htsmsg_add_msg(artifacts_single, NULL, htsmsg_copy(artifact));
+    free(rj->rj_file->mf_json);
 
-            if(amtitle != NULL) {
-              htsmsg_add_str(artifact, "title", amtitle);
-              htsmsg_add_msg(artifacts_all, NULL, artifact);
-              out_all_got_artifacts = 1;
-            } else {
-              htsmsg_destroy(artifact);
-            }
-          }
-        }
-      }
+    if(err == WRITEFILE_NO_CHANGE) {
 
-      htsmsg_add_msg(out_single, "artifacts", artifacts_single);
-      htsmsg_add_msg(out_all,    "artifacts", artifacts_all);
+    } else if(err) {
+      plog(p, rj->rj_logctx,
+           "Unable to write releasetrack file %s -- %s",
+           rj->rj_name, strerror(err));
+    } else {
+      snprintf(logctx, sizeof(logctx), "release/publish/%s",
+               b->b_target);
+      plog(p, logctx,
+           COLOR_GREEN "%s release '%s' available for %s",
+           rj->rj_tracktitle, b->b_version, b->b_target);
+      precompute_patches(rm, b, logctx);
+    }
 
-      if(manifest != NULL) {
-        htsmsg_add_msg(out_single, "manifest", htsmsg_copy(manifest));
-        htsmsg_add_msg(out_all,    "manifest", manifest);
-      }
+    release_fp_t *rf = rj->rj_rf;
+    if(!err || err == WRITEFILE_NO_CHANGE) {
+      rf->rf_fingerprint = rj->rj_fingerprint;
+      if(rf->rf_out_all != NULL)
+        htsmsg_destroy(rf->rf_out_all);
+      rf->rf_out_all = rj->rj_out_all ? htsmsg_copy(rj->rj_out_all) : NULL;
+    } else {
+      rf->rf_fingerprint = 0;
+    }
+  }
 
-      struct change_queue cq;
-      if(!git_changelog(&cq, p, &b->b_oid, 0, 100, 0, b->b_target)) {
-        htsmsg_t *changelog = htsmsg_create_list();
-        change_t *c;
-        TAILQ_FOREACH(c, &cq, link) {
-          htsmsg_t *e = htsmsg_create_map();
-          htsmsg_add_str(e, "version", c->version);
-          htsmsg_add_str(e, "desc", c->msg);
-          htsmsg_add_msg(changelog, NULL, e);
-        }
-        htsmsg_add_msg(out_single, "changelog", changelog);
-        git_changlog_free(&cq);
-      }
+  release_fp_sweep(p);
 
-      char mname[128];
-      snprintf(mname, sizeof(mname), "%s-%s.json", trackid, b->b_target);
+  // Assemble all.json once all parts are done
 
-      int err = write_manifest(rm, out_single, mname);
-      htsmsg_destroy(out_single);
+  const char *extra = cfg_get_str(rm->rt_cfg, CFG("extraInfo"), NULL);
+  allfp = fp_str(allfp, extra);
 
-      if(err == WRITEFILE_NO_CHANGE) {
+  release_cache_t *rc = release_cache_get(p);
+  if(rc->rc_all_fingerprint == allfp && !manifest_missing(rm, "all.json")) {
+    for(int i = 0; i < num_jobs; i++)
+      if(jobs[i].rj_out_all != NULL)
+        htsmsg_destroy(jobs[i].rj_out_all);
+    return;
+  }
 
-      } else if(err) {
-        plog(p, logctx,
-             "Unable to write releasetrack file %s -- %s",
-             mname, strerror(err));
-      } else {
-        snprintf(logctx, sizeof(logctx), "release/publish/%s",
-                 b->b_target);
-        plog(p, logctx,
-             COLOR_GREEN "%s release '%s' available for %s",
-             tracktitle, b->b_version, b->b_target);
-      }
+  htsmsg_t *outtracks = htsmsg_create_list();
+  int slot = 0;
 
+  for(int i = 0; i < num_tracks; i++) {
+    const char *trackid =
+      cfg_get_str(rm->tracks_cfg, CFG(CFG_INDEX(i), "name"),   NULL);
+    const char *tracktitle  =
+      cfg_get_str(rm->tracks_cfg, CFG(CFG_INDEX(i), "title"),   NULL);
+    const char *desc =
+      cfg_get_str(rm->tracks_cfg, CFG(CFG_INDEX(i), "description"), NULL);
 
-      // Only add to all.json if the target had any artifacts at all
+    htsmsg_t *outtargets = htsmsg_create_list();
 
-      if(out_all_got_artifacts) {
-        htsmsg_add_msg(outtargets, NULL, out_all);
+    for(; slot < num_slots && slots[slot].rs_track == i; slot++) {
+      const release_slot_t *rs = &slots[slot];
+      if(rs->rs_job != NULL) {
+        if(rs->rs_job->rj_out_all != NULL)
+          htsmsg_add_msg(outtargets, NULL, rs->rs_job->rj_out_all);
+      } else if(rs->rs_cached != NULL) {
+        htsmsg_add_msg(outtargets, NULL, htsmsg_copy(rs->rs_cached));
       }
     }
 
@@ -643,7 +1424,6 @@ generate_update_tracks(releasemaker_t *rm)
       htsmsg_add_str(outtrack, "description", desc);
       htsmsg_add_msg(outtrack, "targets", outtargets);
 
-      const char *extra = cfg_get_str(rm->rt_cfg, CFG("extraInfo"), NULL);
       if(extra != NULL)
         htsmsg_add_str(outtrack, "extra", extra);
 
@@ -654,6 +1434,8 @@ generate_update_tracks(releasemaker_t *rm)
   int err = write_manifest(rm, outtracks, "all.json");
   htsmsg_destroy(outtracks);
 
+  rc->rc_all_fingerprint = !err || err == WRITEFILE_NO_CHANGE ? allfp : 0;
+
   if(err == WRITEFILE_NO_CHANGE) {
 
   } else if(err) {
@@ -7,6 +7,8 @@ TAILQ_HEAD(artifact_queue, artifact);
 TAILQ_HEAD(build_queue, build);
 TAILQ_HEAD(target_queue, target);
 
+#define BUILD_MAX_PREVIOUS 8
+
 typedef struct artifact {
   TAILQ_ENTRY(artifact) a_link;
   int a_id;
@@ -25,6 +27,8 @@ typedef struct build {
   char b_target[64];
   char b_version[64];
   struct artifact_queue b_artifacts;
+  int b_prev_ids[BUILD_MAX_PREVIOUS]; // Older builds on the same branch
+  int b_num_prev;
 } build_t;
 
 typedef struct target {
@@ -34,3 +38,5 @@ typedef struct target {
 } target_t;
 
 int releasemaker_update_project(project_t *p);
+
+void releasemaker_flush_cache(project_t *p);
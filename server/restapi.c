@@ -13,6 +13,7 @@
 #include "project.h"
 #include "restapi.h"
 #include "git.h"
+#include "manifestcache.h"
 
 #define API_NO_DATA ((htsmsg_t *)-1)
 #define API_ERROR   NULL
@@ -292,10 +293,9 @@ build_json(http_connection_t *hc, int argc, char **argv, int flags)
  *
  */
 static int
-releases_json(http_connection_t *hc, int argc, char **argv, int flags)
+release_manifest(http_connection_t *hc, const char *project, const char *name)
 {
   char path[PATH_MAX];
-  const char *project = argv[1];
 
   project_cfg(pc, project);
   if(pc == NULL)
@@ -306,18 +306,35 @@ releases_json(http_connection_t *hc, int argc, char **argv, int flags)
   if(dir == NULL)
     return 412;
 
-  snprintf(path, sizeof(path), "%s/all.json", dir);
+  // Only the releasemaker knows what's in S3
 
-  int err;
-  char *json = readfile(path, &err, NULL);
-  if(json == NULL) {
-    trace(LOG_ERR, "Unable to read file %s -- %s", path, strerror(err));
-    return 404;
-  }
+  if(!strncmp(dir, "s3://", strlen("s3://")))
+    return manifestcache_serve(hc, project, name);
 
-  htsbuf_append_prealloc(&hc->hc_reply, json, strlen(json));
-  http_output_content(hc, "application/json");
-  return 0;
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return manifestcache_serve_file(hc, project, name, path);
+}
+
+
+/**
+ *
+ */
+static int
+releases_json(http_connection_t *hc, int argc, char **argv, int flags)
+{
+  return release_manifest(hc, argv[1], "all.json");
+}
+
+
+/**
+ *
+ */
+static int
+release_json(http_connection_t *hc, int argc, char **argv, int flags)
+{
+  char name[256];
+  snprintf(name, sizeof(name), "%s.json", argv[2]);
+  return release_manifest(hc, argv[1], name);
 }
 
 
@@ -454,6 +471,8 @@ restapi_init(void)
                  builds_json, 0);
   http_route_add("/projects/([^/]+)/releases.json$",
                  releases_json, 0);
+  http_route_add("/projects/([^/]+)/releases/([^/.]+).json$",
+                 release_json, 0);
   http_route_add("/projects/([^/]+)/builds/([0-9]+).json$",
                  build_json, 0);
   http_route_add("/projects/([^/]+)/revisions/([^.]+).json$",
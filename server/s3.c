@@ -1,4 +1,7 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <openssl/hmac.h>
 #include <curl/curl.h>
@@ -15,6 +18,28 @@ dump_output(char *ptr, size_t size, size_t nmemb, void *userdata)
 }
 
 
+/**
+ * Pick up the ETag S3 returns for an uploaded object
+ */
+static size_t
+etag_header(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  aws_s3_put_t *put = userdata;
+  size_t len = size * nmemb;
+
+  if(len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+    const char *v = ptr + 5;
+    const char *e = ptr + len;
+    while(v < e && (*v == ' ' || *v == '"'))
+      v++;
+    while(e > v && (e[-1] == '\r' || e[-1] == '\n' || e[-1] == '"'))
+      e--;
+    snprintf(put->etag, sizeof(put->etag), "%.*s", (int)(e - v), v);
+  }
+  return len;
+}
+
+
 /**
  *
  */
@@ -94,12 +119,13 @@ aws_s3_delete_file(const char *bucket, const char *awsid, const char *secret,
 /**
  *
  */
-int
-aws_s3_put_file(const char *bucket, const char *awsid, const char *secret,
-                const char *path, char *errbuf, size_t errlen,
-                void *data, size_t len, const char *content_type)
+static CURL *
+s3_put_prepare(const char *bucket, const char *awsid, const char *secret,
+               const char *path, const void *data, size_t len,
+               const char *content_type,
+               FILE **fp, struct curl_slist **slistp)
 {
-  FILE *f = fmemopen(data, len, "r");
+  FILE *f = fmemopen((void *)data, len, "r");
 
   while(*path == '/')
     path++;
@@ -121,6 +147,25 @@ aws_s3_put_file(const char *bucket, const char *awsid, const char *secret,
   curl_easy_setopt(curl, CURLOPT_READDATA, (void *)f);
   curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)len);
 
+  *fp = f;
+  *slistp = slist;
+  return curl;
+}
+
+
+/**
+ *
+ */
+int
+aws_s3_put_file(const char *bucket, const char *awsid, const char *secret,
+                const char *path, char *errbuf, size_t errlen,
+                void *data, size_t len, const char *content_type)
+{
+  FILE *f;
+  struct curl_slist *slist;
+  CURL *curl = s3_put_prepare(bucket, awsid, secret, path, data, len,
+                              content_type, &f, &slist);
+
   CURLcode result = curl_easy_perform(curl);
   curl_slist_free_all(slist);
 
@@ -133,6 +178,86 @@ aws_s3_put_file(const char *bucket, const char *awsid, const char *secret,
 }
 
 
+typedef struct s3_transfer {
+  FILE *f;
+  struct curl_slist *slist;
+  aws_s3_put_t *put;
+} s3_transfer_t;
+
+
+/**
+ * Upload several files, with at most 'parallel' transfers in flight
+ *
+ * The result of each upload ends up in its aws_s3_put_t, returns the
+ * number of failed uploads
+ */
+int
+aws_s3_put_files(const char *bucket, const char *awsid, const char *secret,
+                 aws_s3_put_t *puts, int count, int parallel)
+{
+  CURLM *multi = curl_multi_init();
+  s3_transfer_t *xfers = calloc(count ?: 1, sizeof(s3_transfer_t));
+  int next = 0, running = 0, failed = 0;
+
+  if(parallel < 1)
+    parallel = 1;
+
+  while(next < count || running) {
+
+    while(running < parallel && next < count) {
+      s3_transfer_t *st = &xfers[next];
+      aws_s3_put_t *put = &puts[next];
+      st->put = put;
+      CURL *curl = s3_put_prepare(bucket, awsid, secret, put->path,
+                                  put->data, put->len, put->content_type,
+                                  &st->f, &st->slist);
+      curl_easy_setopt(curl, CURLOPT_PRIVATE, st);
+      curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &etag_header);
+      curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)put);
+      put->etag[0] = 0;
+      curl_multi_add_handle(multi, curl);
+      next++;
+      running++;
+    }
+
+    int still_running;
+    curl_multi_perform(multi, &still_running);
+
+    CURLMsg *msg;
+    int msgs_left;
+    while((msg = curl_multi_info_read(multi, &msgs_left)) != NULL) {
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+
+      CURL *curl = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      s3_transfer_t *st;
+      curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&st);
+
+      st->put->error = !!result;
+      if(result) {
+        snprintf(st->put->errbuf, sizeof(st->put->errbuf),
+                 "CURL error %d", result);
+        failed++;
+      }
+
+      curl_multi_remove_handle(multi, curl);
+      curl_easy_cleanup(curl);
+      curl_slist_free_all(st->slist);
+      fclose(st->f);
+      running--;
+    }
+
+    if(running)
+      curl_multi_wait(multi, NULL, 0, 1000, NULL);
+  }
+
+  free(xfers);
+  curl_multi_cleanup(multi);
+  return failed;
+}
+
+
 /**
  *
  */
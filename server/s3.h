@@ -1,8 +1,25 @@
 #pragma once
 
+#include <stddef.h>
+
 int aws_s3_delete_file(const char *bucket, const char *awsid, const char *secret,
                        const char *path, char *errbuf, size_t errlen);
 
 int aws_s3_put_file(const char *bucket, const char *awsid, const char *secret,
                     const char *path, char *errbuf, size_t errlen,
                     void *data, size_t len, const char *content_type);
+
+typedef struct aws_s3_put {
+  const char *path;
+  const void *data;
+  size_t len;
+  const char *content_type;
+
+  // Result
+  int error;
+  char errbuf[128];
+  char etag[64];
+} aws_s3_put_t;
+
+int aws_s3_put_files(const char *bucket, const char *awsid, const char *secret,
+                     aws_s3_put_t *puts, int count, int parallel);
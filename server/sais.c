@@ -0,0 +1,71 @@
+/*
+ * SA-IS suffix array construction, see sais.h
+ *
+ * Implements the induced sorting algorithm from G. Nong, S. Zhang and
+ * W. H. Chan, "Two Efficient Algorithms for Linear Time Suffix Array
+ * Construction". The bucket and induction passes in sais_impl.h are
+ * derived from Yuta Mori's sais-lite, which carries this notice:
+ *
+ * Copyright (c) 2008-2010 Yuta Mori All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "sais.h"
+
+/**
+ * Suffix type bitmap, a set bit means S-type
+ */
+#define TGET(t, i) (((t)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+#define TSET(t, i, b) do {                                      \
+    if(b)                                                       \
+      (t)[(i) >> 3] |= 0x80 >> ((i) & 7);                       \
+    else                                                        \
+      (t)[(i) >> 3] &= ~(0x80 >> ((i) & 7));                    \
+  } while(0)
+
+#define ISLMS(t, i) ((i) > 0 && TGET(t, i) && !TGET(t, (i) - 1))
+
+/**
+ * Character accessor. At level 0 's8' points to the input bytes
+ * which are shifted up by one so the virtual sentinel at n - 1 can
+ * be 0. Deeper levels use the reduced string in 'sN' as-is.
+ */
+#define CHR(i) (s8 != NULL ?                                    \
+                ((i) == n - 1 ? 0 : (SAIDX)s8[i] + 1) : sN[i])
+
+
+#define SAIDX int32_t
+#define SAFN(x) x ## 32
+#include "sais_impl.h"
+#undef SAIDX
+#undef SAFN
+
+#define SAIDX int64_t
+#define SAFN(x) x ## 64
+#include "sais_impl.h"
+#undef SAIDX
+#undef SAFN
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Linear time suffix array construction (SA-IS, Nong, Zhang & Chan)
+ *
+ * Sorts all suffixes of the byte string 'T' of length 'n' and stores
+ * their start offsets in 'SA', which must have room for n + 1 entries.
+ * The empty suffix (offset n) is included and always sorts first,
+ * so the result is laid out exactly like the 'I' array produced by
+ * the classic Larsson-Sadakane qsufsort() used by bsdiff.
+ *
+ * sais32() requires n < INT32_MAX, sais64() handles everything else.
+ *
+ * Returns 0 on success, -1 if memory could not be allocated
+ */
+int sais32(const uint8_t *T, int32_t *SA, int32_t n);
+
+int sais64(const uint8_t *T, int64_t *SA, int64_t n);
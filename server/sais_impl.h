@@ -0,0 +1,210 @@
+/*
+ * SA-IS suffix sorting, instantiated by sais.c once per index width
+ *
+ * Before inclusion SAIDX must be defined to the (signed) index type
+ * and SAFN(x) must mangle function names for that width.
+ *
+ * Level 0 sorts the raw bytes (with a virtual sentinel), all deeper
+ * levels sort the reduced string of LMS-substring names. See sais.c
+ * for the accessor macros.
+ *
+ * Derived from Yuta Mori's sais-lite, see sais.c for copyright and
+ * license.
+ */
+
+
+/**
+ * Compute start (end == 0) or end (end == 1) of each character bucket
+ */
+static void
+SAFN(get_buckets)(const uint8_t *s8, const SAIDX *sN, SAIDX n,
+                  SAIDX *bkt, SAIDX K, int end)
+{
+  SAIDX i, sum = 0;
+
+  for(i = 0; i <= K; i++)
+    bkt[i] = 0;
+  for(i = 0; i < n; i++)
+    bkt[CHR(i)]++;
+  for(i = 0; i <= K; i++) {
+    sum += bkt[i];
+    bkt[i] = end ? sum : sum - bkt[i];
+  }
+}
+
+
+/**
+ * Induce the order of the L-type suffixes
+ */
+static void
+SAFN(induce_l)(const uint8_t *t, SAIDX *SA,
+               const uint8_t *s8, const SAIDX *sN, SAIDX n,
+               SAIDX *bkt, SAIDX K)
+{
+  SAIDX i, j;
+
+  SAFN(get_buckets)(s8, sN, n, bkt, K, 0);
+  for(i = 0; i < n; i++) {
+    j = SA[i] - 1;
+    if(j >= 0 && !TGET(t, j))
+      SA[bkt[CHR(j)]++] = j;
+  }
+}
+
+
+/**
+ * Induce the order of the S-type suffixes
+ */
+static void
+SAFN(induce_s)(const uint8_t *t, SAIDX *SA,
+               const uint8_t *s8, const SAIDX *sN, SAIDX n,
+               SAIDX *bkt, SAIDX K)
+{
+  SAIDX i, j;
+
+  SAFN(get_buckets)(s8, sN, n, bkt, K, 1);
+  for(i = n - 1; i >= 0; i--) {
+    j = SA[i] - 1;
+    if(j >= 0 && TGET(t, j))
+      SA[--bkt[CHR(j)]] = j;
+  }
+}
+
+
+/**
+ * Sort the suffixes of a string of length 'n' (n >= 2) over the
+ * alphabet [0..K] where the last character is a unique, smallest
+ * sentinel
+ */
+static int
+SAFN(sais_main)(const uint8_t *s8, const SAIDX *sN, SAIDX *SA,
+                SAIDX n, SAIDX K)
+{
+  SAIDX i, j, d, n1, name, prev, pos;
+  SAIDX *bkt;
+  uint8_t *t;
+
+  if((t = calloc(1, n / 8 + 1)) == NULL)
+    return -1;
+
+  // Classify each suffix as S- or L-type
+
+  TSET(t, n - 2, 0);
+  TSET(t, n - 1, 1);
+  for(i = n - 3; i >= 0; i--)
+    TSET(t, i, CHR(i) < CHR(i + 1) ||
+         (CHR(i) == CHR(i + 1) && TGET(t, i + 1)));
+
+  // Stage 1: Sort all LMS-substrings
+
+  if((bkt = malloc(sizeof(SAIDX) * (K + 1))) == NULL) {
+    free(t);
+    return -1;
+  }
+
+  SAFN(get_buckets)(s8, sN, n, bkt, K, 1);
+  for(i = 0; i < n; i++)
+    SA[i] = -1;
+  for(i = 1; i < n; i++)
+    if(ISLMS(t, i))
+      SA[--bkt[CHR(i)]] = i;
+
+  SAFN(induce_l)(t, SA, s8, sN, n, bkt, K);
+  SAFN(induce_s)(t, SA, s8, sN, n, bkt, K);
+  free(bkt);
+
+  // Compact the sorted LMS-substrings into the first n1 slots
+
+  n1 = 0;
+  for(i = 0; i < n; i++)
+    if(ISLMS(t, SA[i]))
+      SA[n1++] = SA[i];
+
+  // Name the LMS-substrings, equal substrings get the same name
+
+  for(i = n1; i < n; i++)
+    SA[i] = -1;
+
+  name = 0;
+  prev = -1;
+  for(i = 0; i < n1; i++) {
+    int diff = 0;
+    pos = SA[i];
+    for(d = 0; d < n; d++) {
+      if(prev == -1 || CHR(pos + d) != CHR(prev + d) ||
+         TGET(t, pos + d) != TGET(t, prev + d)) {
+        diff = 1;
+        break;
+      }
+      if(d > 0 && (ISLMS(t, pos + d) || ISLMS(t, prev + d)))
+        break;
+    }
+    if(diff) {
+      name++;
+      prev = pos;
+    }
+    SA[n1 + pos / 2] = name - 1;
+  }
+
+  for(i = n - 1, j = n - 1; i >= n1; i--)
+    if(SA[i] >= 0)
+      SA[j--] = SA[i];
+
+  // Stage 2: Sort the reduced string, recursing if names are not unique
+
+  SAIDX *SA1 = SA;
+  SAIDX *s1 = SA + n - n1;
+
+  if(name < n1) {
+    if(SAFN(sais_main)(NULL, s1, SA1, n1, name - 1)) {
+      free(t);
+      return -1;
+    }
+  } else {
+    for(i = 0; i < n1; i++)
+      SA1[s1[i]] = i;
+  }
+
+  // Stage 3: Induce the final order from the sorted LMS-suffixes
+
+  if((bkt = malloc(sizeof(SAIDX) * (K + 1))) == NULL) {
+    free(t);
+    return -1;
+  }
+
+  SAFN(get_buckets)(s8, sN, n, bkt, K, 1);
+  for(i = 1, j = 0; i < n; i++)
+    if(ISLMS(t, i))
+      s1[j++] = i;
+  for(i = 0; i < n1; i++)
+    SA1[i] = s1[SA1[i]];
+  for(i = n1; i < n; i++)
+    SA[i] = -1;
+  for(i = n1 - 1; i >= 0; i--) {
+    j = SA[i];
+    SA[i] = -1;
+    SA[--bkt[CHR(j)]] = j;
+  }
+
+  SAFN(induce_l)(t, SA, s8, sN, n, bkt, K);
+  SAFN(induce_s)(t, SA, s8, sN, n, bkt, K);
+
+  free(bkt);
+  free(t);
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+SAFN(sais)(const uint8_t *T, SAIDX *SA, SAIDX n)
+{
+  if(n == 0) {
+    SA[0] = 0;
+    return 0;
+  }
+  // Byte values are shifted up by one to make room for the sentinel
+  return SAFN(sais_main)(T, NULL, SA, n + 1, 256);
+}
@@ -1,6 +1,6 @@
 #pragma once
 
-#define SQL_GET_ARTIFACT_BY_SHA1 "SELECT storage,payload,project,name,artifact.type,contenttype,encoding FROM artifact,build WHERE artifact.sha1=? AND build.id = artifact.build_id"
+#define SQL_GET_ARTIFACT_BY_SHA1 "SELECT storage,payload,project,name,artifact.type,contenttype,encoding,GREATEST(IFNULL(origsize,0),0) FROM artifact,build WHERE artifact.sha1=? AND build.id = artifact.build_id"
 
 #define SQL_INCREASE_DLCOUNT_BY_SHA1 "UPDATE artifact SET dlcount = dlcount + 1 WHERE sha1 = ?"
 
@@ -27,7 +27,6 @@
 #define SQL_GET_RELEASES "SELECT id,target,version,revision FROM build INNER JOIN (SELECT max(id) AS id FROM build WHERE status='done' AND project=? GROUP BY target) latest USING (id)"
 
 
-#define SQL_GET_ARTIFACTS "SELECT id,type,sha1,size,name FROM artifact WHERE build_id = ?"
 
 #define SQL_GET_DELETED_ARTIFACTS "SELECT id,name,storage,payload,project FROM deleted_artifact WHERE error IS NULL LIMIT 1"
 
@@ -35,3 +34,4 @@
 
 #define SQL_FAIL_DELETED_ARTIFACT "UPDATE deleted_artifact SET error=? WHERE id=?"
 
+#define SQL_SET_S3_MANIFEST "INSERT INTO s3_manifest (bucket,path,md5,etag) VALUES (?,?,?,?) ON DUPLICATE KEY UPDATE md5=VALUES(md5),etag=VALUES(etag)"
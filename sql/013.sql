@@ -0,0 +1,8 @@
+CREATE TABLE s3_manifest (
+       bucket VARCHAR(64) NOT NULL,
+       path VARCHAR(190) NOT NULL,
+       md5 CHAR(32) NOT NULL,
+       etag VARCHAR(64),
+       updated TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,
+       PRIMARY KEY (bucket, path)
+) ENGINE InnoDB;
@@ -0,0 +1 @@
+ALTER TABLE artifact MODIFY origsize BIGINT;